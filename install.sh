@@ -47,7 +47,7 @@ fi
 
 
 # Compil
-make -s -C ${DIR}
+make -s -C ${DIR} all images
 if [ "$?" = "0" ] ; then
     strip ${DIR}/trx_lms7002m.so
     rm -f ${DST}/trx_lms7002m.so
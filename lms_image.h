@@ -0,0 +1,47 @@
+/*
+ * Binary LMS7002M register image
+ *
+ * Compiled from a LimeSuite INI register dump by lms_ini2bin, loaded by
+ * trx_lms7002m instead of LMS_LoadConfig when config_file ends in ".bin".
+ * All fields are little endian:
+ *
+ *   LmsImageHeader
+ *   LmsImageReg[count]     in INI order, MAC A section first
+ *
+ * Copyright (C) 2020 Amarisoft/LimeMicro
+ */
+#ifndef LMS_IMAGE_H
+#define LMS_IMAGE_H
+
+#include <stdint.h>
+
+#define LMS_IMAGE_MAGIC     0x424D4C53  /* "SLMB" */
+#define LMS_IMAGE_VERSION   1
+#define LMS_IMAGE_MAX_REGS  4096
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;             /* registers */
+    uint32_t sxt_ref_hz;        /* [reference_clocks], 0 if absent */
+    uint32_t sxr_ref_hz;
+    uint32_t checksum;          /* lms_image_checksum of the registers */
+} LmsImageHeader;
+
+typedef struct {
+    uint16_t addr;
+    uint16_t val;
+    uint16_t mac;               /* 1: channel A, 2: channel B */
+} LmsImageReg;
+
+/* FNV-1a */
+static inline uint32_t lms_image_checksum(const LmsImageReg *reg, int count)
+{
+    const uint8_t *p = (const uint8_t *)reg;
+    uint32_t h = 0x811c9dc5;
+    for (int i = 0; i < count * (int)sizeof(LmsImageReg); i++)
+        h = (h ^ p[i]) * 0x01000193;
+    return h;
+}
+
+#endif /* LMS_IMAGE_H */
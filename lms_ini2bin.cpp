@@ -0,0 +1,135 @@
+/*
+ * Compile a LimeSuite INI register dump into a binary register image
+ *
+ *   lms_ini2bin LimeSDR_USB_below_1p8GHz_2ch.ini LimeSDR_USB_below_1p8GHz_2ch.bin
+ *
+ * The image (lms_image.h) is loaded by trx_lms7002m when config_file ends
+ * in ".bin": no INI parsing at start, and only the registers differing
+ * from the chip are written.
+ *
+ * Copyright (C) 2020 Amarisoft/LimeMicro
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "lms_image.h"
+
+static LmsImageReg regs[LMS_IMAGE_MAX_REGS];
+
+static char *strip(char *s)
+{
+    char *e;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    e = s + strlen(s);
+    while (e > s && isspace((unsigned char)e[-1]))
+        *--e = 0;
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    LmsImageHeader hdr;
+    char line[256];
+    enum { SEC_OTHER, SEC_INFO, SEC_MAC_A, SEC_MAC_B, SEC_CLOCKS } sec = SEC_OTHER;
+    bool minimal = false;
+    int count = 0, lineno = 0;
+    FILE *f;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s config.ini image.bin\n", argv[0]);
+        return 1;
+    }
+    f = fopen(argv[1], "r");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    while (fgets(line, sizeof(line), f)) {
+        char *s = strip(line), *eq;
+        unsigned addr, val;
+
+        lineno++;
+        if (!*s || *s == '#' || *s == ';')
+            continue;
+        if (*s == '[') {
+            if (!strcmp(s, "[file_info]"))
+                sec = SEC_INFO;
+            else if (!strcmp(s, "[lms7002_registers_a]"))
+                sec = SEC_MAC_A;
+            else if (!strcmp(s, "[lms7002_registers_b]"))
+                sec = SEC_MAC_B;
+            else if (!strcmp(s, "[reference_clocks]"))
+                sec = SEC_CLOCKS;
+            else
+                sec = SEC_OTHER;
+            continue;
+        }
+        eq = strchr(s, '=');
+        if (!eq)
+            goto syntax;
+        *eq++ = 0;
+        s = strip(s);
+        eq = strip(eq);
+        switch (sec) {
+        case SEC_INFO:
+            if (!strcmp(s, "type") && !strcmp(eq, "lms7002m_minimal_config"))
+                minimal = true;
+            break;
+        case SEC_MAC_A:
+        case SEC_MAC_B:
+            if (sscanf(s, "%x", &addr) != 1 || sscanf(eq, "%x", &val) != 1 ||
+                addr > 0xFFFF || val > 0xFFFF)
+                goto syntax;
+            if (count >= LMS_IMAGE_MAX_REGS) {
+                fprintf(stderr, "%s: more than %d registers\n", argv[1], LMS_IMAGE_MAX_REGS);
+                return 1;
+            }
+            regs[count].addr = addr;
+            regs[count].val = val;
+            regs[count].mac = sec == SEC_MAC_A ? 1 : 2;
+            count++;
+            break;
+        case SEC_CLOCKS:
+            if (!strcmp(s, "sxt_ref_clk_mhz"))
+                hdr.sxt_ref_hz = (uint32_t)(atof(eq) * 1e6 + 0.5);
+            else if (!strcmp(s, "sxr_ref_clk_mhz"))
+                hdr.sxr_ref_hz = (uint32_t)(atof(eq) * 1e6 + 0.5);
+            break;
+        default:
+            break;
+        }
+        continue;
+    syntax:
+        fprintf(stderr, "%s:%d: syntax error\n", argv[1], lineno);
+        return 1;
+    }
+    fclose(f);
+    if (!minimal || !count) {
+        fprintf(stderr, "%s: not a lms7002m_minimal_config register dump\n", argv[1]);
+        return 1;
+    }
+
+    hdr.magic = LMS_IMAGE_MAGIC;
+    hdr.version = LMS_IMAGE_VERSION;
+    hdr.count = count;
+    hdr.checksum = lms_image_checksum(regs, count);
+    f = fopen(argv[2], "wb");
+    if (!f) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(regs, sizeof(regs[0]), count, f) != (size_t)count ||
+        fclose(f) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("%s: %d registers\n", argv[2], count);
+    return 0;
+}
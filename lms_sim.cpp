@@ -0,0 +1,871 @@
+/*
+ * Simulated LimeSuite backend for trx_lms7002m
+ *
+ * Implements the subset of the LimeSuite C API used by the driver, so the
+ * driver can be built and benchmarked without a board:
+ *   make trx_lms7002m_sim.so
+ *
+ * Each simulated board runs a sample clock from the host monotonic clock at
+ * the configured sample rate. RX streams deliver samples in USB sized packets
+ * with real timestamps; TX streams accept timestamped samples, with optional
+ * loopback of TX into RX of the same channel. LMS_SetLOFrequency programs
+ * the SX registers (INT/FRAC, LO divider) and takes as long as a VCO search,
+ * LMS_GetLOFrequency reads them back.
+ *
+ * Behaviour is configured from the environment:
+ *   LMS_SIM_DEVICES       number of boards in the device list (1)
+ *   LMS_SIM_LOOPBACK      1: RX receives what was sent on TX (0)
+ *   LMS_SIM_LATENCY_US    USB transfer latency (200)
+ *   LMS_SIM_JITTER_US     random extra latency per transfer (0)
+ *   LMS_SIM_OVERRUN_PPM   probability of a lost RX packet, per packet (0)
+ *   LMS_SIM_UNDERRUN_PPM  probability of an injected TX underrun, per call (0)
+ *   LMS_SIM_DEV_OFFSET    timestamp offset between boards in samples (0)
+ *   LMS_SIM_TEMP          chip temperature (40.0)
+ *   LMS_SIM_REPLAY        RX replays the SigMF recordings <prefix>_rx<n>
+ *   LMS_SIM_REPLAY_PACE   "realtime" or "max" (realtime)
+ * The replay can also be set by the driver (replay parameter), through
+ * lms_sim_replay().
+ *
+ * Replay: RX channel n plays <prefix>_rx<n>.sigmf-data in a loop, or the
+ * highest recorded channel below n, as written by the driver "record"
+ * command. The file is mapped and copied straight into the read buffers
+ * when its format is the stream format. At "max" pace the board clock
+ * follows the reads instead of the host clock: RX never waits, TX is a
+ * sink that still drops late packets but never blocks.
+ *
+ * Copyright (C) 2020 Amarisoft/LimeMicro
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <pthread.h>
+#include <lime/LimeSuite.h>
+
+#define SIM_MAX_DEV         8
+#define SIM_MAX_CH          4
+#define SIM_MAX_STREAM      (SIM_MAX_DEV * SIM_MAX_CH * 2)
+#define SIM_RING_SAMPLES    (1 << 20)   /* loopback memory, power of 2 */
+#define SIM_DEFAULT_RATE    30.72e6
+#define SIM_REF_CLK         30.72e6
+#define SIM_MAX_GAIN        73          /* dB, LMS_SetGaindB clamps like LimeSuite */
+#define SIM_VCO_SEARCH_US   20000       /* LMS_SetLOFrequency */
+#define SIM_SX_REG          0x011C      /* SXR on MAC A, SXT on MAC B */
+
+struct SimDevice {
+    bool open;
+    int index;
+    double sample_rate;
+    double ref_clk;
+    int64_t ts_offset;
+    std::atomic<int64_t> t_start;       /* ns, 0: not streaming */
+    std::atomic<int64_t> vtime;         /* board clock at "max" replay pace */
+    int active_streams;
+    lms_dev_info_t info;
+    uint16_t regs[2][0x10000];          /* registers of both MAC channels */
+    uint16_t mac;
+    unsigned gain[2][SIM_MAX_CH];
+    float *ring[SIM_MAX_CH];            /* loopback, interleaved I/Q */
+};
+
+struct SimStream {
+    bool used;
+    SimDevice *dev;
+    lms_stream_t *conf;
+    bool active;
+    int64_t ts;                         /* next RX sample / end of last TX */
+    uint32_t rng;
+    std::atomic<uint32_t> underrun;
+    std::atomic<uint32_t> overrun;
+    std::atomic<uint32_t> dropped;
+    /* RX replay */
+    const uint8_t *replay;
+    size_t replay_size;                 /* bytes mapped */
+    int64_t replay_len;                 /* samples */
+    int replay_fmt;                     /* lms_stream_t dataFmt of the file */
+    int64_t replay_t0;                  /* timestamp of file sample 0 */
+};
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    int dev_count;
+    bool loopback;
+    int latency_us;
+    int jitter_us;
+    int overrun_ppm;
+    int underrun_ppm;
+    int64_t dev_offset;
+    double temp;
+    char replay[256];
+    bool unthrottled;
+    SimDevice dev[SIM_MAX_DEV];
+    SimStream stream[SIM_MAX_STREAM];
+    LMS_LogHandler log;
+} sim = { PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER };
+
+static int sim_env_int(const char *name, int def)
+{
+    const char *v = getenv(name);
+    return v ? atoi(v) : def;
+}
+
+static void sim_init(void)
+{
+    const char *v;
+
+    sim.dev_count = sim_env_int("LMS_SIM_DEVICES", 1);
+    if (sim.dev_count < 1)
+        sim.dev_count = 1;
+    if (sim.dev_count > SIM_MAX_DEV)
+        sim.dev_count = SIM_MAX_DEV;
+    sim.loopback = sim_env_int("LMS_SIM_LOOPBACK", 0) != 0;
+    sim.latency_us = sim_env_int("LMS_SIM_LATENCY_US", 200);
+    sim.jitter_us = sim_env_int("LMS_SIM_JITTER_US", 0);
+    sim.overrun_ppm = sim_env_int("LMS_SIM_OVERRUN_PPM", 0);
+    sim.underrun_ppm = sim_env_int("LMS_SIM_UNDERRUN_PPM", 0);
+    sim.dev_offset = sim_env_int("LMS_SIM_DEV_OFFSET", 0);
+    v = getenv("LMS_SIM_TEMP");
+    sim.temp = v ? atof(v) : 40.0;
+    v = getenv("LMS_SIM_REPLAY");
+    if (v)
+        snprintf(sim.replay, sizeof(sim.replay), "%s", v);
+    v = getenv("LMS_SIM_REPLAY_PACE");
+    sim.unthrottled = sim.replay[0] && v && !strcmp(v, "max");
+}
+
+static void sim_log(int lvl, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void sim_log(int lvl, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (sim.log)
+        sim.log(lvl, buf);
+    else
+        fprintf(stderr, "LMS_SIM: %s\n", buf);
+}
+
+static int64_t sim_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift, one generator per stream to stay lock free */
+static uint32_t sim_rand(SimStream *st)
+{
+    uint32_t x = st->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return st->rng = x;
+}
+
+/* Board sample clock, only valid while streaming */
+static int64_t sim_dev_time(SimDevice *d, int64_t now_ns)
+{
+    int64_t t0 = d->t_start.load(std::memory_order_acquire);
+    if (!t0)
+        return 0;
+    if (sim.unthrottled)
+        return d->vtime.load(std::memory_order_relaxed);
+    return d->ts_offset + (int64_t)((now_ns - t0) * 1e-9 * d->sample_rate);
+}
+
+static int64_t sim_ns_of(SimDevice *d, int64_t dev_ts)
+{
+    return d->t_start.load(std::memory_order_acquire) +
+        (int64_t)((dev_ts - d->ts_offset) * 1e9 / d->sample_rate);
+}
+
+static void sim_sleep_until(int64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Samples per USB packet, as the LimeSuite streamer packs them */
+static int sim_packet_samples(const SimStream *st)
+{
+    int ch = 0;
+    for (int i = 0; i < SIM_MAX_STREAM; i++)
+        if (sim.stream[i].used && sim.stream[i].dev == st->dev &&
+            sim.stream[i].conf->isTx == st->conf->isTx)
+            ch++;
+    if (ch < 1)
+        ch = 1;
+    return (st->conf->linkFmt == lms_stream_t::LMS_LINK_FMT_I16 ? 1020 : 1360) / ch;
+}
+
+static SimDevice *sim_dev(lms_device_t *device)
+{
+    return (SimDevice*)device;
+}
+
+static SimStream *sim_stream(lms_stream_t *stream)
+{
+    if (stream->handle >= SIM_MAX_STREAM || !sim.stream[stream->handle].used)
+        return NULL;
+    return &sim.stream[stream->handle];
+}
+
+/* Sample format conversion, full scale is 2047 for I12 */
+static void sim_store(const lms_stream_t *conf, void *dst, int idx, float i, float q)
+{
+    switch (conf->dataFmt) {
+    case lms_stream_t::LMS_FMT_F32:
+        ((float*)dst)[2*idx] = i;
+        ((float*)dst)[2*idx+1] = q;
+        break;
+    case lms_stream_t::LMS_FMT_I16:
+        ((int16_t*)dst)[2*idx] = (int16_t)lrintf(i * 32767.0f);
+        ((int16_t*)dst)[2*idx+1] = (int16_t)lrintf(q * 32767.0f);
+        break;
+    default:
+        ((int16_t*)dst)[2*idx] = (int16_t)lrintf(i * 2047.0f);
+        ((int16_t*)dst)[2*idx+1] = (int16_t)lrintf(q * 2047.0f);
+        break;
+    }
+}
+
+static void sim_load(const lms_stream_t *conf, const void *src, int idx, float *i, float *q)
+{
+    switch (conf->dataFmt) {
+    case lms_stream_t::LMS_FMT_F32:
+        *i = ((const float*)src)[2*idx];
+        *q = ((const float*)src)[2*idx+1];
+        break;
+    case lms_stream_t::LMS_FMT_I16:
+        *i = ((const int16_t*)src)[2*idx] * (1.0f / 32767.0f);
+        *q = ((const int16_t*)src)[2*idx+1] * (1.0f / 32767.0f);
+        break;
+    default:
+        *i = ((const int16_t*)src)[2*idx] * (1.0f / 2047.0f);
+        *q = ((const int16_t*)src)[2*idx+1] * (1.0f / 2047.0f);
+        break;
+    }
+}
+
+/*
+ * Replay
+ */
+
+/* Called by the driver before opening the boards */
+extern "C" API_EXPORT int CALL_CONV lms_sim_replay(const char *prefix, int unthrottled)
+{
+    pthread_once(&sim.once, sim_init);
+    snprintf(sim.replay, sizeof(sim.replay), "%s", prefix);
+    sim.unthrottled = unthrottled != 0;
+    return 0;
+}
+
+/* Stream format of a SigMF recording, from its metadata; -1 if unusable */
+static int sim_replay_format(const char *meta_path, double *rate)
+{
+    char buf[4096];
+    FILE *f = fopen(meta_path, "r");
+    if (!f)
+        return -1;
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+
+    const char *p = strstr(buf, "\"core:sample_rate\"");
+    *rate = p && (p = strchr(p, ':')) ? atof(p + 1) : 0;
+    p = strstr(buf, "\"core:datatype\"");
+    if (!p)
+        return -1;
+    if (strstr(p, "\"cf32_le\""))
+        return lms_stream_t::LMS_FMT_F32;
+    if (strstr(p, "\"ci16_le\""))
+        return strstr(buf, "12 bit") ? lms_stream_t::LMS_FMT_I12 : lms_stream_t::LMS_FMT_I16;
+    return -1;
+}
+
+/* Map the recording of RX channel 'ch' into 'st' */
+static int sim_replay_open(SimStream *st, int ch, double sample_rate)
+{
+    char path[300];
+    int fd = -1;
+
+    for (; ch >= 0 && fd < 0; ch--) {
+        snprintf(path, sizeof(path), "%s_rx%d.sigmf-data", sim.replay, ch);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        sim_log(LMS_LOG_ERROR, "%s_rx0.sigmf-data: no recording", sim.replay);
+        return -1;
+    }
+    double rate;
+    strcpy(strrchr(path, '.'), ".sigmf-meta");
+    st->replay_fmt = sim_replay_format(path, &rate);
+    struct stat sb;
+    if (st->replay_fmt < 0 || fstat(fd, &sb) != 0 || sb.st_size == 0) {
+        sim_log(LMS_LOG_ERROR, "%s: not a ci16_le/cf32_le recording", path);
+        close(fd);
+        return -1;
+    }
+    if (rate && sample_rate && fabs(rate - sample_rate) > 1)
+        sim_log(LMS_LOG_WARNING, "%s: recorded at %.0f Hz, replayed at %.0f Hz", path, rate, sample_rate);
+    void *m = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        sim_log(LMS_LOG_ERROR, "%s: cannot map", path);
+        return -1;
+    }
+    madvise(m, sb.st_size, MADV_SEQUENTIAL);
+    st->replay = (const uint8_t*)m;
+    st->replay_size = sb.st_size;
+    st->replay_len = sb.st_size / (st->replay_fmt == lms_stream_t::LMS_FMT_F32 ? 8 : 4);
+    return 0;
+}
+
+static void sim_replay_close(SimStream *st)
+{
+    if (st->replay)
+        munmap((void*)st->replay, st->replay_size);
+    st->replay = NULL;
+}
+
+/* 'n' replayed samples from timestamp 'ts', looping over the file */
+static void sim_replay_read(SimStream *st, void *samples, int64_t ts, int64_t n)
+{
+    const lms_stream_t *conf = st->conf;
+    const int fsize = st->replay_fmt == lms_stream_t::LMS_FMT_F32 ? 8 : 4;
+    int64_t pos = (ts - st->replay_t0) % st->replay_len;
+    lms_stream_t file = *conf;
+
+    if (pos < 0)
+        pos += st->replay_len;
+    file.dataFmt = (decltype(file.dataFmt))st->replay_fmt;
+    for (int64_t done = 0; done < n; ) {
+        int64_t k = st->replay_len - pos < n - done ? st->replay_len - pos : n - done;
+        const uint8_t *src = st->replay + pos * fsize;
+        if (st->replay_fmt == (int)conf->dataFmt) {
+            memcpy((uint8_t*)samples + done * fsize, src, k * fsize);
+        } else {
+            for (int64_t i = 0; i < k; i++) {
+                float re, im;
+                sim_load(&file, src, i, &re, &im);
+                sim_store(conf, samples, done + i, re, im);
+            }
+        }
+        done += k;
+        pos = 0;
+    }
+}
+
+/*
+ * Device
+ */
+
+API_EXPORT int CALL_CONV LMS_GetDeviceList(lms_info_str_t *dev_list)
+{
+    pthread_once(&sim.once, sim_init);
+    if (dev_list)
+        for (int i = 0; i < sim.dev_count; i++)
+            snprintf(dev_list[i], sizeof(lms_info_str_t),
+                     "LimeSDR-SIM, media=SIM, addr=sim:%d, serial=%016X", i, 0x5100 + i);
+    return sim.dev_count;
+}
+
+API_EXPORT int CALL_CONV LMS_Open(lms_device_t **device, const lms_info_str_t info, void* args)
+{
+    int idx = 0;
+    const char *p;
+
+    pthread_once(&sim.once, sim_init);
+    if (info && (p = strstr(info, "addr=sim:")) != NULL)
+        idx = atoi(p + 9);
+    if (idx < 0 || idx >= sim.dev_count)
+        return -1;
+
+    pthread_mutex_lock(&sim.lock);
+    SimDevice *d = &sim.dev[idx];
+    if (d->open) {
+        pthread_mutex_unlock(&sim.lock);
+        sim_log(LMS_LOG_ERROR, "board %d already open", idx);
+        return -1;
+    }
+    d->open = true;
+    d->index = idx;
+    d->sample_rate = SIM_DEFAULT_RATE;
+    d->ref_clk = 30.72e6;
+    d->ts_offset = idx * sim.dev_offset;
+    d->t_start = 0;
+    d->active_streams = 0;
+    d->mac = 1;
+    memset(&d->info, 0, sizeof(d->info));
+    strcpy(d->info.deviceName, "LimeSDR-SIM");
+    strcpy(d->info.firmwareVersion, "0");
+    strcpy(d->info.hardwareVersion, "0");
+    strcpy(d->info.protocolVersion, "1");
+    d->info.boardSerialNumber = 0x5100 + idx;
+    if (sim.loopback)
+        for (int ch = 0; ch < SIM_MAX_CH; ch++)
+            d->ring[ch] = (float*)calloc(SIM_RING_SAMPLES * 2, sizeof(float));
+    pthread_mutex_unlock(&sim.lock);
+    *device = d;
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_Close(lms_device_t *device)
+{
+    SimDevice *d = sim_dev(device);
+
+    pthread_mutex_lock(&sim.lock);
+    for (int ch = 0; ch < SIM_MAX_CH; ch++) {
+        free(d->ring[ch]);
+        d->ring[ch] = NULL;
+    }
+    d->open = false;
+    pthread_mutex_unlock(&sim.lock);
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_Init(lms_device_t *device)
+{
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_LoadConfig(lms_device_t *device, const char *filename)
+{
+    if (access(filename, R_OK) != 0) {
+        sim_log(LMS_LOG_ERROR, "%s: not readable", filename);
+        return -1;
+    }
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_SaveConfig(lms_device_t *device, const char *filename)
+{
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_EnableCache(lms_device_t *dev, bool enable)
+{
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_EnableChannel(lms_device_t *device, bool dir_tx, size_t chan, bool enabled)
+{
+    return chan < SIM_MAX_CH ? 0 : -1;
+}
+
+API_EXPORT int CALL_CONV LMS_SetSampleRate(lms_device_t *device, float_type rate, size_t oversample)
+{
+    sim_dev(device)->sample_rate = rate;
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_SetSampleRateDir(lms_device_t *device, bool dir_tx, float_type rate, size_t oversample)
+{
+    sim_dev(device)->sample_rate = rate;
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_GetSampleRate(lms_device_t *device, bool dir_tx, size_t chan, float_type *host_Hz, float_type *rf_Hz)
+{
+    if (host_Hz)
+        *host_Hz = sim_dev(device)->sample_rate;
+    if (rf_Hz)
+        *rf_Hz = sim_dev(device)->sample_rate * 4;
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_GetClockFreq(lms_device_t *device, size_t clk_id, float_type *freq)
+{
+    if (clk_id != LMS_CLOCK_REF)
+        return -1;
+    *freq = sim_dev(device)->ref_clk;
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_SetClockFreq(lms_device_t *device, size_t clk_id, float_type freq)
+{
+    if (clk_id != LMS_CLOCK_REF)
+        return -1;
+    sim_dev(device)->ref_clk = freq;
+    return 0;
+}
+
+/* fVCO = fREF * (INT_SDM + 4 + FRAC_SDM / 2^20), fLO = fVCO / 2^(DIV_LOCH + 1) */
+API_EXPORT int CALL_CONV LMS_SetLOFrequency(lms_device_t *device, bool dir_tx, size_t chan, float_type frequency)
+{
+    SimDevice *d = sim_dev(device);
+    uint16_t *sx = &d->regs[dir_tx][SIM_SX_REG];
+    int div = 0;
+
+    if (frequency < 30e6 || frequency > 3.8e9)
+        return -1;
+    while (frequency * (2 << div) < 3.8e9 && div < 6)
+        div++;
+    double n = frequency * (2 << div) / SIM_REF_CLK;
+    uint32_t frac = (uint32_t)((n - floor(n)) * (1 << 20));
+    sx[1] = frac & 0xFFFF;
+    sx[2] = ((int)n - 4) << 4 | frac >> 16;
+    sx[3] = (sx[3] & ~(7 << 6)) | div << 6;
+    usleep(SIM_VCO_SEARCH_US);
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_GetLOFrequency(lms_device_t *device, bool dir_tx, size_t chan, float_type *frequency)
+{
+    SimDevice *d = sim_dev(device);
+    const uint16_t *sx = &d->regs[dir_tx][SIM_SX_REG];
+    double n = (sx[2] >> 4) + 4 + (((sx[2] & 15) << 16) | sx[1]) / (double)(1 << 20);
+
+    *frequency = n * SIM_REF_CLK / (2 << ((sx[3] >> 6) & 7));
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_GetAntenna(lms_device_t *device, bool dir_tx, size_t chan)
+{
+    return 1;
+}
+
+API_EXPORT int CALL_CONV LMS_SetAntenna(lms_device_t *device, bool dir_tx, size_t chan, size_t index)
+{
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_SetGaindB(lms_device_t *device, bool dir_tx, size_t chan, unsigned gain)
+{
+    if (chan >= SIM_MAX_CH)
+        return -1;
+    sim_dev(device)->gain[dir_tx][chan] = gain < SIM_MAX_GAIN ? gain : SIM_MAX_GAIN;
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_GetGaindB(lms_device_t *device, bool dir_tx, size_t chan, unsigned *gain)
+{
+    if (chan >= SIM_MAX_CH)
+        return -1;
+    *gain = sim_dev(device)->gain[dir_tx][chan];
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_SetLPFBW(lms_device_t *device, bool dir_tx, size_t chan, float_type bandwidth)
+{
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_Calibrate(lms_device_t *device, bool dir_tx, size_t chan, double bw, unsigned flags)
+{
+    /* roughly the time a real calibration blocks */
+    usleep(20000);
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_WriteCustomBoardParam(lms_device_t *device, uint8_t id, float_type val, const lms_name_t units)
+{
+    return 0;
+}
+
+API_EXPORT const lms_dev_info_t* CALL_CONV LMS_GetDeviceInfo(lms_device_t *device)
+{
+    return &sim_dev(device)->info;
+}
+
+API_EXPORT int CALL_CONV LMS_GetChipTemperature(lms_device_t *dev, size_t ind, float_type *temp)
+{
+    *temp = sim.temp;
+    return 0;
+}
+
+/* Register 0x0020 selects the MAC channel of the following accesses */
+API_EXPORT int CALL_CONV LMS_ReadLMSReg(lms_device_t *device, uint32_t address, uint16_t *val)
+{
+    SimDevice *d = sim_dev(device);
+    if (address == 0x0020)
+        *val = d->mac;
+    else
+        *val = d->regs[d->mac == 2][address & 0xFFFF];
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_WriteLMSReg(lms_device_t *device, uint32_t address, uint16_t val)
+{
+    SimDevice *d = sim_dev(device);
+    if (address == 0x0020) {
+        d->mac = val & 3;
+        return 0;
+    }
+    if (d->mac & 1)
+        d->regs[0][address & 0xFFFF] = val;
+    if (d->mac & 2)
+        d->regs[1][address & 0xFFFF] = val;
+    return 0;
+}
+
+API_EXPORT void CALL_CONV LMS_RegisterLogHandler(LMS_LogHandler handler)
+{
+    sim.log = handler;
+}
+
+API_EXPORT const char * CALL_CONV LMS_GetLastErrorMessage(void)
+{
+    return "simulated device";
+}
+
+/*
+ * Streams
+ */
+
+API_EXPORT int CALL_CONV LMS_SetupStream(lms_device_t *device, lms_stream_t *stream)
+{
+    if (stream->channel >= SIM_MAX_CH)
+        return -1;
+    pthread_mutex_lock(&sim.lock);
+    for (int i = 0; i < SIM_MAX_STREAM; i++) {
+        SimStream *st = &sim.stream[i];
+        if (st->used)
+            continue;
+        st->used = true;
+        st->dev = sim_dev(device);
+        st->conf = stream;
+        st->active = false;
+        st->ts = 0;
+        st->rng = 0x9E3779B9u ^ (i * 0x85EBCA6Bu);
+        st->underrun = 0;
+        st->overrun = 0;
+        st->dropped = 0;
+        st->replay = NULL;
+        if (sim.replay[0] && !stream->isTx) {
+            /* RX streams are set up in driver channel order */
+            int ch = 0;
+            for (int j = 0; j < SIM_MAX_STREAM; j++)
+                if (j != i && sim.stream[j].used && !sim.stream[j].conf->isTx)
+                    ch++;
+            if (sim_replay_open(st, ch, st->dev->sample_rate) != 0) {
+                st->used = false;
+                pthread_mutex_unlock(&sim.lock);
+                return -1;
+            }
+        }
+        if (stream->fifoSize == 0)
+            stream->fifoSize = 256 * 1024;
+        stream->handle = i;
+        pthread_mutex_unlock(&sim.lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return -1;
+}
+
+API_EXPORT int CALL_CONV LMS_DestroyStream(lms_device_t *dev, lms_stream_t *stream)
+{
+    SimStream *st = sim_stream(stream);
+    if (!st)
+        return -1;
+    pthread_mutex_lock(&sim.lock);
+    sim_replay_close(st);
+    st->used = false;
+    pthread_mutex_unlock(&sim.lock);
+    return 0;
+}
+
+/* The board clock starts with the first stream, like the FPGA counter */
+API_EXPORT int CALL_CONV LMS_StartStream(lms_stream_t *stream)
+{
+    SimStream *st = sim_stream(stream);
+    if (!st)
+        return -1;
+    pthread_mutex_lock(&sim.lock);
+    SimDevice *d = st->dev;
+    if (d->active_streams++ == 0) {
+        d->vtime.store(d->ts_offset, std::memory_order_relaxed);
+        d->t_start.store(sim_now_ns(), std::memory_order_release);
+    }
+    st->ts = sim_dev_time(d, sim_now_ns());
+    st->replay_t0 = st->ts;
+    st->active = true;
+    pthread_mutex_unlock(&sim.lock);
+    return 0;
+}
+
+API_EXPORT int CALL_CONV LMS_StopStream(lms_stream_t *stream)
+{
+    SimStream *st = sim_stream(stream);
+    if (!st)
+        return -1;
+    pthread_mutex_lock(&sim.lock);
+    if (st->active && --st->dev->active_streams == 0)
+        st->dev->t_start.store(0, std::memory_order_release);
+    st->active = false;
+    pthread_mutex_unlock(&sim.lock);
+    return 0;
+}
+
+/* Newest sample the host can have received at 'now': the board clock
+ * delayed by the USB latency, in whole packets */
+static int64_t sim_rx_avail(SimStream *st, int64_t now)
+{
+    int64_t lat = sim.latency_us * 1000LL;
+    int pkt = sim_packet_samples(st);
+
+    if (sim.jitter_us > 0)
+        lat += (sim_rand(st) % sim.jitter_us) * 1000LL;
+    int64_t t = sim_dev_time(st->dev, now - lat);
+    return t - (t - st->dev->ts_offset) % pkt;
+}
+
+API_EXPORT int CALL_CONV LMS_RecvStream(lms_stream_t *stream, void *samples, size_t sample_count, lms_stream_meta_t *meta, unsigned timeout_ms)
+{
+    SimStream *st = sim_stream(stream);
+    if (!st || !st->active)
+        return -1;
+    SimDevice *d = st->dev;
+    int pkt = sim_packet_samples(st);
+    int64_t deadline = sim_now_ns() + timeout_ms * 1000000LL;
+    int64_t avail;
+
+    if (sim.unthrottled) {
+        /* the board clock follows the reads */
+        sim_replay_read(st, samples, st->ts, sample_count);
+        if (meta)
+            meta->timestamp = st->ts;
+        st->ts += sample_count;
+        int64_t t = d->vtime.load(std::memory_order_relaxed);
+        while (t < st->ts && !d->vtime.compare_exchange_weak(t, st->ts, std::memory_order_relaxed))
+            ;
+        return sample_count;
+    }
+
+    /* FIFO overflow: the oldest data is lost */
+    avail = sim_rx_avail(st, sim_now_ns());
+    if (avail - st->ts > (int64_t)stream->fifoSize) {
+        st->overrun++;
+        st->ts = avail - stream->fifoSize / 2;
+    }
+    /* lost packets */
+    if (sim.overrun_ppm > 0) {
+        int64_t n = (avail - st->ts) / pkt;
+        for (int64_t i = 0; i < n; i++) {
+            if ((int)(sim_rand(st) % 1000000) < sim.overrun_ppm) {
+                st->dropped++;
+                st->ts += pkt;
+            }
+        }
+    }
+
+    while ((avail = sim_rx_avail(st, sim_now_ns())) < st->ts + (int64_t)sample_count) {
+        int64_t wake = sim_ns_of(d, st->ts + sample_count) + sim.latency_us * 1000LL;
+        if (wake > deadline) {
+            sim_sleep_until(deadline);
+            avail = sim_rx_avail(st, sim_now_ns());
+            break;
+        }
+        sim_sleep_until(wake);
+    }
+
+    int64_t n = avail - st->ts;
+    if (n <= 0)
+        return 0;
+    if (n > (int64_t)sample_count)
+        n = sample_count;
+
+    if (st->replay) {
+        sim_replay_read(st, samples, st->ts, n);
+        if (meta)
+            meta->timestamp = st->ts;
+        st->ts += n;
+        return n;
+    }
+    float *ring = d->ring[stream->channel];
+    for (int64_t i = 0; i < n; i++) {
+        float re = 0, im = 0;
+        if (ring) {
+            size_t k = (size_t)(st->ts + i) & (SIM_RING_SAMPLES - 1);
+            re = ring[2*k];
+            im = ring[2*k+1];
+            ring[2*k] = ring[2*k+1] = 0;
+        }
+        sim_store(stream, samples, i, re, im);
+    }
+    if (meta)
+        meta->timestamp = st->ts;
+    st->ts += n;
+    return n;
+}
+
+API_EXPORT int CALL_CONV LMS_SendStream(lms_stream_t *stream, const void *samples, size_t sample_count, const lms_stream_meta_t *meta, unsigned timeout_ms)
+{
+    SimStream *st = sim_stream(stream);
+    if (!st || !st->active)
+        return -1;
+    SimDevice *d = st->dev;
+    int64_t now = sim_now_ns();
+    int64_t ts = meta && meta->waitForTimestamp ? (int64_t)meta->timestamp : st->ts;
+    int64_t dev_now = sim_dev_time(d, now);
+
+    /* arrives at the board after the USB latency: too late is dropped.
+       Timestamped gaps are sent as zeros by the FPGA and are not underruns */
+    if (ts < sim_dev_time(d, now + sim.latency_us * 1000LL)) {
+        st->dropped++;
+        return sample_count;
+    }
+    if (sim.underrun_ppm > 0 && (int)(sim_rand(st) % 1000000) < sim.underrun_ppm)
+        st->underrun++;
+
+    /* FIFO full: block like the real streamer */
+    int64_t over = ts + sample_count - dev_now - stream->fifoSize;
+    if (over > 0 && !sim.unthrottled) {
+        int64_t wake = sim_ns_of(d, dev_now + over);
+        if (wake - now > timeout_ms * 1000000LL) {
+            sim_sleep_until(now + timeout_ms * 1000000LL);
+            return 0;
+        }
+        sim_sleep_until(wake);
+    }
+
+    /* replaying, TX is only a sink */
+    float *ring = sim.replay[0] ? NULL : d->ring[stream->channel];
+    if (ring) {
+        for (size_t i = 0; i < sample_count; i++) {
+            size_t k = (size_t)(ts + i) & (SIM_RING_SAMPLES - 1);
+            sim_load(stream, samples, i, &ring[2*k], &ring[2*k+1]);
+        }
+    }
+    st->ts = ts + sample_count;
+    return sample_count;
+}
+
+/* Error counts are reset by each query, like LimeSuite */
+API_EXPORT int CALL_CONV LMS_GetStreamStatus(lms_stream_t *stream, lms_stream_status_t* status)
+{
+    SimStream *st = sim_stream(stream);
+    if (!st)
+        return -1;
+    SimDevice *d = st->dev;
+    int64_t dev_now = sim_dev_time(d, sim_now_ns());
+    int64_t fill = stream->isTx ? st->ts - dev_now : sim_rx_avail(st, sim_now_ns()) - st->ts;
+
+    memset(status, 0, sizeof(*status));
+    status->active = st->active;
+    status->fifoSize = stream->fifoSize;
+    status->fifoFilledCount = fill < 0 ? 0 : fill > stream->fifoSize ? stream->fifoSize : fill;
+    status->underrun = st->underrun.exchange(0);
+    status->overrun = st->overrun.exchange(0);
+    status->droppedPackets = st->dropped.exchange(0);
+    status->sampleRate = d->sample_rate;
+    status->linkRate = d->sample_rate * 4 * 1.5;
+    status->timestamp = st->active ? dev_now : 0;
+    return 0;
+}
@@ -0,0 +1,561 @@
+/*
+ * Load generator for TRX drivers
+ *
+ * Loads a TRX driver (trx_lms7002m.so or trx_lms7002m_sim.so) like LTEENB
+ * does and runs RX/TX threads at subframe cadence on every RF port:
+ *   - the RX thread reads one subframe (or slot) per call,
+ *   - the TX thread writes the matching subframe 'tx_advance' later with
+ *     trx_write_func2, sending TDD uplink subframes as padding.
+ * Reports the sustained sample rate, CPU usage per Msps, late writes and
+ * read/write call latency percentiles, for each sample format and channel
+ * count requested.
+ *
+ *   trx_bench [options] [driver.so]
+ *     -f formats    comma separated sample_format list (12b,16b,float)
+ *     -c channels   comma separated channel count list (1,2)
+ *     -p ports      RF ports, channels are split evenly (1)
+ *     -b bandwidth  LTE bandwidth in MHz, selects the sample rate (20)
+ *     -d seconds    run time of each configuration (10)
+ *     -u slot_us    read/write granularity in us, 1000 for LTE, 500 for NR 30 kHz
+ *     -t pattern    TDD pattern of D/S/U per slot, e.g. DSUUD (FDD); also
+ *                   passed to the driver as a LTE TDD cell (1 ms slots,
+ *                   a 36.211 UL/DL configuration) or else a NR TDD cell
+ *                   (D..DSU..U over a NR periodicity)
+ *     -a slots      TX advance in slots (4)
+ *     -o name=value driver parameter, may be repeated
+ *
+ * Copyright (C) 2020 Amarisoft/LimeMicro
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "trx_driver.h"
+
+#define MAX_OPTS        64
+#define QUEUE_SIZE      64      /* slots between the RX and TX threads */
+
+struct BenchParam {
+    const char *name;
+    const char *value;
+};
+
+struct BenchConfig {
+    const char *driver;
+    BenchParam opt[MAX_OPTS];
+    int opt_count;
+    int port_count;
+    int bandwidth;
+    int duration;
+    int slot_us;
+    const char *tdd;
+    int tx_advance;
+};
+
+struct BenchPort;
+
+struct BenchRun {
+    const BenchConfig *cfg;
+    TRXState *s;
+    std::atomic<bool> stop;
+    int slot_samples;
+};
+
+struct BenchPort {
+    BenchRun *run;
+    int index;
+    int rx_count;
+    int tx_count;
+    pthread_t rx_thread;
+    pthread_t tx_thread;
+
+    /* RX -> TX: timestamps of received slots */
+    trx_timestamp_t queue[QUEUE_SIZE];
+    std::atomic<uint32_t> q_head;
+    std::atomic<uint32_t> q_tail;
+
+    int64_t rx_samples;
+    int64_t rx_short;
+    int64_t rx_gap;
+    int64_t tx_late;
+    int64_t tx_margin_min;
+    std::vector<int64_t> rx_lat;
+    std::vector<int64_t> tx_lat;
+};
+
+static int64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t get_cpu_ns(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+/*
+ * Parameter callbacks, backed by the -o options
+ */
+
+static const char *bench_find_param(const BenchConfig *cfg, const char *name)
+{
+    /* last one wins */
+    for (int i = cfg->opt_count - 1; i >= 0; i--)
+        if (!strcmp(cfg->opt[i].name, name))
+            return cfg->opt[i].value;
+    return NULL;
+}
+
+static char *bench_get_param_string(void *opaque, const char *prop_name)
+{
+    const char *v = bench_find_param((const BenchConfig*)opaque, prop_name);
+    return v ? strdup(v) : NULL;
+}
+
+static int bench_get_param_double(void *opaque, double *pval, const char *prop_name)
+{
+    const char *v = bench_find_param((const BenchConfig*)opaque, prop_name);
+    char *end;
+
+    if (!v)
+        return -1;
+    *pval = strtod(v, &end);
+    return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * Slot pattern
+ */
+
+static char bench_slot_type(const BenchConfig *cfg, trx_timestamp_t ts, int slot_samples)
+{
+    if (!cfg->tdd)
+        return 'D';
+    int n = strlen(cfg->tdd);
+    return cfg->tdd[(ts / slot_samples) % n];
+}
+
+/* LTE UL/DL configurations, 36.211 table 4.2-2 */
+static const char bench_lte_uldl[7][11] = {
+    "DSUUUDSUUU", "DSUUDDSUUD", "DSUDDDSUDD", "DSUUUDDDDD",
+    "DSUUDDDDDD", "DSUDDDDDDD", "DSUUUDSUUD",
+};
+/* NR dl-UL-TransmissionPeriodicity, in us */
+static const int bench_nr_period_us[10] = {
+    500, 625, 1000, 1250, 2000, 2500, 5000, 10000, 3000, 4000,
+};
+
+/* TDD cell of the -t pattern, so that the driver gates TX like with
+ * LTEENB. The special slot is split 10 DL / 2 GP / 2 UL symbols. */
+static int bench_tdd_cell(const BenchConfig *cfg, int port, TRXCellInfo *c)
+{
+    const char *t = cfg->tdd;
+    int n = strlen(t);
+
+    memset(c, 0, sizeof(*c));
+    c->rf_port_index = port;
+    if (cfg->slot_us == 1000 && (n == 5 || n == 10)) {
+        for (int i = 0; i < 7; i++) {
+            if (memcmp(t, bench_lte_uldl[i], n) || (n == 5 && memcmp(t, bench_lte_uldl[i] + 5, 5)))
+                continue;
+            c->type = TRXCellInfo::TRX_CELL_TYPE_TDD;
+            c->u.tdd.uldl_config = i;
+            c->u.tdd.special_subframe_config = 7;
+            return 0;
+        }
+    }
+
+    int mu = 0;
+    while (mu <= 3 && (1000 >> mu) != cfg->slot_us)
+        mu++;
+    int dl = strspn(t, "D");
+    int sp = t[dl] == 'S';
+    int ul = strspn(t + dl + sp, "U");
+    if (mu > 3 || !dl || dl + sp + ul != n)
+        return -1;
+    for (int i = 0; i < 10; i++) {
+        if (bench_nr_period_us[i] != n * cfg->slot_us)
+            continue;
+        c->type = TRXCellInfo::TRX_NRCELL_TYPE_TDD;
+        c->u.nr_tdd.band = 78;
+        c->u.nr_tdd.dl_subcarrier_spacing = c->u.nr_tdd.ul_subcarrier_spacing = mu;
+        c->u.nr_tdd.period_asn1 = i;
+        c->u.nr_tdd.dl_slots = dl;
+        c->u.nr_tdd.dl_symbs = sp ? 10 : 0;
+        c->u.nr_tdd.ul_slots = ul;
+        c->u.nr_tdd.ul_symbs = sp ? 2 : 0;
+        return 0;
+    }
+    return -1;
+}
+
+static void *bench_rx_thread(void *arg)
+{
+    BenchPort *p = (BenchPort*)arg;
+    BenchRun *r = p->run;
+    int n = r->slot_samples;
+    std::vector<TRXComplex> buf((size_t)n * p->rx_count);
+    void *bufs[TRX_MAX_CHANNELS];
+    trx_timestamp_t ts, next = -1;
+    TRXReadMetadata md;
+
+    for (int ch = 0; ch < p->rx_count; ch++)
+        bufs[ch] = &buf[(size_t)ch * n];
+
+    while (!r->stop.load(std::memory_order_relaxed)) {
+        memset(&md, 0, sizeof(md));
+        int64_t t0 = get_time_ns();
+        int ret = r->s->trx_read_func2(r->s, &ts, bufs, n, p->index, &md);
+        p->rx_lat.push_back(get_time_ns() - t0);
+        if (ret < n)
+            p->rx_short++;
+        if (ret <= 0)
+            continue;
+        if (next >= 0 && ts != next)
+            p->rx_gap++;
+        next = ts + ret;
+        p->rx_samples += ret;
+
+        /* hand the slot over to TX, dropped if TX does not keep up */
+        uint32_t head = p->q_head.load(std::memory_order_relaxed);
+        if (head - p->q_tail.load(std::memory_order_acquire) < QUEUE_SIZE) {
+            p->queue[head % QUEUE_SIZE] = ts;
+            p->q_head.store(head + 1, std::memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+static void *bench_tx_thread(void *arg)
+{
+    BenchPort *p = (BenchPort*)arg;
+    BenchRun *r = p->run;
+    const BenchConfig *cfg = r->cfg;
+    int n = r->slot_samples;
+    std::vector<TRXComplex> buf((size_t)n * p->tx_count);
+    const void *bufs[TRX_MAX_CHANNELS];
+    TRXWriteMetadata md;
+
+    /* a tone at -6 dBFS, enough to exercise the conversion */
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i].re = (i & 4) ? 0.5f : -0.5f;
+        buf[i].im = (i & 2) ? 0.5f : -0.5f;
+    }
+    for (int ch = 0; ch < p->tx_count; ch++)
+        bufs[ch] = &buf[(size_t)ch * n];
+
+    while (!r->stop.load(std::memory_order_relaxed)) {
+        uint32_t tail = p->q_tail.load(std::memory_order_relaxed);
+        if (tail == p->q_head.load(std::memory_order_acquire)) {
+            usleep(50);
+            continue;
+        }
+        trx_timestamp_t ts = p->queue[tail % QUEUE_SIZE] + (trx_timestamp_t)cfg->tx_advance * n;
+        p->q_tail.store(tail + 1, std::memory_order_release);
+
+        memset(&md, 0, sizeof(md));
+        md.flags = TRX_WRITE_MD_FLAG_CUR_TIMESTAMP_REQ;
+        char type = bench_slot_type(cfg, ts, n);
+        const void **samples = bufs;
+        if (type == 'U') {
+            md.flags |= TRX_WRITE_MD_FLAG_PADDING;
+            samples = NULL;
+        } else if (bench_slot_type(cfg, ts + n, n) == 'U') {
+            md.flags |= TRX_WRITE_MD_FLAG_END_OF_BURST;
+        }
+
+        int64_t t0 = get_time_ns();
+        r->s->trx_write_func2(r->s, ts, samples, n, p->index, &md);
+        p->tx_lat.push_back(get_time_ns() - t0);
+        if (md.cur_timestamp_set) {
+            int64_t margin = ts - md.cur_timestamp;
+            if (margin < 0)
+                p->tx_late++;
+            if (margin < p->tx_margin_min)
+                p->tx_margin_min = margin;
+        }
+    }
+    return NULL;
+}
+
+static double bench_percentile(std::vector<int64_t> &v, double q)
+{
+    if (v.empty())
+        return 0;
+    size_t k = (size_t)(q * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k] / 1000.0;
+}
+
+static void bench_print_lat(const char *name, std::vector<int64_t> &v)
+{
+    printf("  %s us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f (%zu calls)\n", name,
+           bench_percentile(v, 0.5), bench_percentile(v, 0.9),
+           bench_percentile(v, 0.99), bench_percentile(v, 0.999),
+           bench_percentile(v, 1.0), v.size());
+}
+
+static void bench_dump_cb(void *opaque, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+/* Run one format/channel count configuration, return < 0 on error */
+static int bench_run(BenchConfig *cfg, const char *format, int channels)
+{
+    void *lib;
+    int (*init)(TRXState *);
+    TRXState s;
+    TRXDriverParams tp;
+    TRXFraction rate;
+    int rate_num;
+    TRXCellInfo cells[TRX_MAX_RF_PORT];
+    BenchRun r;
+    BenchPort ports[TRX_MAX_RF_PORT];
+    int ret = -1;
+
+    if (channels % cfg->port_count) {
+        fprintf(stderr, "%d channels cannot be split over %d ports\n", channels, cfg->port_count);
+        return -1;
+    }
+
+    /* fresh driver instance for each configuration */
+    lib = dlopen(cfg->driver, RTLD_NOW | RTLD_LOCAL);
+    if (!lib) {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+    init = (int (*)(TRXState *))dlsym(lib, "trx_driver_init");
+    if (!init) {
+        fprintf(stderr, "%s: no trx_driver_init\n", cfg->driver);
+        dlclose(lib);
+        return -1;
+    }
+
+    cfg->opt[cfg->opt_count].name = "sample_format";
+    cfg->opt[cfg->opt_count].value = format;
+    cfg->opt_count++;
+
+    memset(&s, 0, sizeof(s));
+    s.trx_api_version = TRX_API_VERSION;
+    s.app_opaque = cfg;
+    s.trx_get_param_string = bench_get_param_string;
+    s.trx_get_param_double = bench_get_param_double;
+    s.path = ".";
+    if (init(&s) < 0) {
+        fprintf(stderr, "trx_driver_init failed\n");
+        goto done;
+    }
+    if (!s.trx_read_func2 || !s.trx_write_func2 || !s.trx_start_func) {
+        fprintf(stderr, "driver does not implement read/write v2\n");
+        goto end;
+    }
+
+    memset(&rate, 0, sizeof(rate));
+    if (s.trx_get_sample_rate_func(&s, &rate, &rate_num, cfg->bandwidth * 1000000) < 0) {
+        fprintf(stderr, "no sample rate for %d MHz\n", cfg->bandwidth);
+        goto end;
+    }
+
+    memset(&tp, 0, sizeof(tp));
+    tp.rx_channel_count = tp.tx_channel_count = channels;
+    tp.rf_port_count = cfg->port_count;
+    for (int ch = 0; ch < channels; ch++) {
+        tp.rx_freq[ch] = 2535000000LL;
+        tp.tx_freq[ch] = 2655000000LL;
+        tp.rx_gain[ch] = 50;
+        tp.tx_gain[ch] = 60;
+        tp.rx_bandwidth[ch] = tp.tx_bandwidth[ch] = cfg->bandwidth * 1000000;
+    }
+    for (int i = 0; i < cfg->port_count; i++) {
+        tp.sample_rate[i] = rate;
+        tp.rx_port_channel_count[i] = tp.tx_port_channel_count[i] = channels / cfg->port_count;
+        if (cfg->tdd && bench_tdd_cell(cfg, i, &cells[i]) < 0) {
+            fprintf(stderr, "%s: no LTE or NR TDD configuration with %d us slots\n", cfg->tdd, cfg->slot_us);
+            goto end;
+        }
+    }
+    if (cfg->tdd) {
+        tp.cell_info = cells;
+        tp.cell_count = cfg->port_count;
+    }
+    if (s.trx_start_func(&s, &tp) < 0) {
+        fprintf(stderr, "trx_start_func failed\n");
+        goto end;
+    }
+
+    r.cfg = cfg;
+    r.s = &s;
+    r.stop = false;
+    r.slot_samples = (int)((int64_t)rate.num * cfg->slot_us / rate.den / 1000000);
+
+    {
+        int64_t t0 = get_time_ns(), c0 = get_cpu_ns();
+
+        for (int i = 0; i < cfg->port_count; i++) {
+            BenchPort *p = &ports[i];
+            p->run = &r;
+            p->index = i;
+            p->rx_count = p->tx_count = channels / cfg->port_count;
+            p->q_head = p->q_tail = 0;
+            p->rx_samples = p->rx_short = p->rx_gap = p->tx_late = 0;
+            p->tx_margin_min = INT64_MAX;
+            p->rx_lat.reserve((size_t)cfg->duration * 1000000 / cfg->slot_us + 16);
+            p->tx_lat.reserve((size_t)cfg->duration * 1000000 / cfg->slot_us + 16);
+            pthread_create(&p->rx_thread, NULL, bench_rx_thread, p);
+            pthread_create(&p->tx_thread, NULL, bench_tx_thread, p);
+        }
+        sleep(cfg->duration);
+        r.stop = true;
+        for (int i = 0; i < cfg->port_count; i++) {
+            pthread_join(ports[i].rx_thread, NULL);
+            pthread_join(ports[i].tx_thread, NULL);
+        }
+
+        double wall = (get_time_ns() - t0) * 1e-9;
+        double cpu = (get_cpu_ns() - c0) * 1e-9;
+        int64_t samples = 0, shorts = 0, gaps = 0, late = 0;
+        int64_t margin = INT64_MAX;
+        for (int i = 0; i < cfg->port_count; i++) {
+            samples += ports[i].rx_samples * ports[i].rx_count;
+            shorts += ports[i].rx_short;
+            gaps += ports[i].rx_gap;
+            late += ports[i].tx_late;
+            margin = std::min(margin, ports[i].tx_margin_min);
+        }
+        double msps = samples / wall / 1e6;
+        double nominal = (double)rate.num / rate.den / 1e6 * channels;
+
+        printf("%s, %d ch, %d port(s), %.2f MSps/ch, %s:\n", format, channels,
+               cfg->port_count, (double)rate.num / rate.den / 1e6, cfg->tdd ? cfg->tdd : "FDD");
+        printf("  RX %.3f MSps sustained (%.1f%% of nominal), %" PRId64 " short reads, %" PRId64 " gaps\n",
+               msps, 100.0 * msps / nominal, shorts, gaps);
+        printf("  CPU %.1f%% (%.2f%% per MSps)\n", 100.0 * cpu / wall,
+               msps > 0 ? 100.0 * cpu / wall / msps : 0.0);
+        if (margin != INT64_MAX)
+            printf("  TX %" PRId64 " late writes, min margin %" PRId64 " samples\n", late, margin);
+        for (int i = 0; i < cfg->port_count; i++) {
+            printf(" port %d\n", i);
+            bench_print_lat("read ", ports[i].rx_lat);
+            bench_print_lat("write", ports[i].tx_lat);
+        }
+        if (s.trx_get_stats) {
+            TRXStatistics st;
+            if (s.trx_get_stats(&s, &st) == 0)
+                printf("  driver: tx_underflow %" PRId64 " rx_overflow %" PRId64 "\n",
+                       st.tx_underflow_count, st.rx_overflow_count);
+        }
+        if (s.trx_dump_info)
+            s.trx_dump_info(&s, bench_dump_cb, NULL);
+    }
+    ret = 0;
+
+ end:
+    if (s.trx_end_func)
+        s.trx_end_func(&s);
+ done:
+    cfg->opt_count--;
+    dlclose(lib);
+    return ret;
+}
+
+static void help(void)
+{
+    printf("usage: trx_bench [-f formats] [-c channels] [-p ports] [-b MHz] [-d s]\n"
+           "                 [-u slot_us] [-t DSU..] [-a slots] [-o name=value] [driver.so]\n");
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig cfg;
+    std::vector<std::string> formats, channels;
+    const char *fmt_list = "12b,16b,float", *ch_list = "1,2";
+    int c;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.driver = "./trx_lms7002m.so";
+    cfg.port_count = 1;
+    cfg.bandwidth = 20;
+    cfg.duration = 10;
+    cfg.slot_us = 1000;
+    cfg.tx_advance = 4;
+
+    while ((c = getopt(argc, argv, "f:c:p:b:d:u:t:a:o:h")) != -1) {
+        switch (c) {
+        case 'f': fmt_list = optarg; break;
+        case 'c': ch_list = optarg; break;
+        case 'p': cfg.port_count = atoi(optarg); break;
+        case 'b': cfg.bandwidth = atoi(optarg); break;
+        case 'd': cfg.duration = atoi(optarg); break;
+        case 'u': cfg.slot_us = atoi(optarg); break;
+        case 't': cfg.tdd = optarg; break;
+        case 'a': cfg.tx_advance = atoi(optarg); break;
+        case 'o': {
+            char *eq = strchr(optarg, '=');
+            if (!eq || cfg.opt_count >= MAX_OPTS - 1) {
+                help();
+                return 1;
+            }
+            *eq = '\0';
+            cfg.opt[cfg.opt_count].name = optarg;
+            cfg.opt[cfg.opt_count].value = eq + 1;
+            cfg.opt_count++;
+            break;
+        }
+        default:
+            help();
+            return 1;
+        }
+    }
+    if (optind < argc)
+        cfg.driver = argv[optind];
+    if (cfg.port_count < 1 || cfg.port_count > TRX_MAX_RF_PORT || cfg.slot_us <= 0 ||
+        cfg.duration <= 0) {
+        help();
+        return 1;
+    }
+    if (cfg.driver[0] != '/' && !strchr(cfg.driver, '/')) {
+        static std::string path;
+        path = std::string("./") + cfg.driver;
+        cfg.driver = path.c_str();
+    }
+
+    for (const char *p = fmt_list; *p; ) {
+        const char *e = strchr(p, ',');
+        formats.push_back(e ? std::string(p, e - p) : std::string(p));
+        p = e ? e + 1 : p + strlen(p);
+    }
+    for (const char *p = ch_list; *p; ) {
+        const char *e = strchr(p, ',');
+        channels.push_back(e ? std::string(p, e - p) : std::string(p));
+        p = e ? e + 1 : p + strlen(p);
+    }
+
+    int errors = 0;
+    for (size_t f = 0; f < formats.size(); f++)
+        for (size_t n = 0; n < channels.size(); n++)
+            if (bench_run(&cfg, formats[f].c_str(), atoi(channels[n].c_str())) < 0)
+                errors++;
+    return errors ? 1 : 0;
+}
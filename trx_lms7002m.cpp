@@ -7,45 +7,408 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <getopt.h>
 #include <math.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <iostream>
+#include <atomic>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include <lime/LimeSuite.h>
 
 extern "C" {
 #include "trx_driver.h"
 };
+#include "lms_image.h"
+
+/* Replay hook of the simulated LimeSuite (lms_sim.cpp), absent from the
+   real library */
+extern "C" int lms_sim_replay(const char *prefix, int unthrottled) __attribute__((weak));
 
 #define CALIBRATE_FILTER    2
 #define CALIBRATE_IQDC      1
-#define MAX_NUM_CH 2
+#define CALIBRATE_FORCE     4       /* ignore the calibration cache */
+#define CAL_MAX_AGE         (7*24)  /* hours a cached calibration stays valid */
+#define CAL_TEMP_STEP       10      /* degC per temperature bucket of the cache */
+#define MAX_NUM_DEV 4        /* boards aggregated in one instance */
+#define MAX_NUM_CH 8
+#define MAX_NUM_PORT MAX_NUM_CH
+#define SYNC_TOLERANCE      2048    /* samples of board drift before realign */
+#define SYNC_MEASURES       15
+#define HW_CLOCK_SLACK_PPM  100     /* board/host clock drift followed by cur_timestamp */
+#define FIFO_SIZE           (256*1024)
+#define FIFO_TVL            0.3f
+#define FIFO_MIN            (16*1024)
+#define FIFO_MAX            (4*1024*1024)
+#define FIFO_RELAX_TICKS    300     /* error free ticks before shrinking the FIFO */
+#define FIFO_WARMUP_TICKS   3       /* start up errors are not held against the FIFO */
+#define DGAIN_RANGE         1.0     /* dB of gain change applied digitally only */
+#define STREAM_TIMEOUT_MS   30
+#define RX_PUMP_RING_MS     20      /* RX ring of the pump thread */
+#define RX_PUMP_BLOCK_US    250     /* samples pulled per LMS_RecvStream */
+#define TX_QUEUE_MS         10      /* TX queue of the writer thread */
+#define TX_COALESCE_US      500     /* a partial TX packet is flushed this long before its time */
+#define RX_FILL_US          2000    /* longest RX gap zero-filled */
+#define REC_BLOCK_US        500     /* recorder ring slot */
+#define REC_POLL_MS         2       /* recorder thread period */
+#define RETUNE_MAX          32      /* frequencies of the retune table */
+#define SX_REG_FIRST        0x011C  /* SXR (MAC 1) / SXT (MAC 2) registers */
+#define SX_REG_COUNT        9
+#define HUGEPAGE_SIZE       (2 * 1024 * 1024)
 using namespace std;
 typedef struct TRXLmsState          TRXLmsState;
 
+/* Event counters. Each one lives on its own cache line and has a single
+ * writer on the streaming path (plain relaxed load/store, no locked
+ * instruction); stream status is folded in by trx_lms7002m_poll_status(). */
+enum {
+    CNT_TX_UNDERRUN,        /* LimeSuite TX FIFO underruns */
+    CNT_TX_DROPPED,         /* TX packets dropped by LimeSuite (late timestamp) */
+    CNT_TX_LATE,            /* writes for a timestamp already received */
+    CNT_TX_MISALIGNED,      /* TDD bursts not starting on a downlink boundary */
+    CNT_TX_UPLINK,          /* TDD writes entirely in uplink time, dropped */
+    CNT_TX_CLIP,            /* TX scalars saturated by the conversion */
+    CNT_TX_QUEUE_FULL,      /* writes dropped, the TX writer queue stayed full */
+    CNT_TX_PARTIAL,         /* partial packets flushed by the TX coalescing */
+    CNT_TX_REC_DROPPED,     /* TX blocks not recorded, the recorder fell behind */
+    CNT_RX_OVERRUN,         /* LimeSuite RX FIFO overruns */
+    CNT_RX_DROPPED,         /* RX packets lost */
+    CNT_RX_GAP,             /* RX timestamp discontinuities */
+    CNT_RX_FILL,            /* RX samples zero-filled over gaps */
+    CNT_RX_TRIM,            /* RX samples dropped, already delivered */
+    CNT_RX_SKEW,            /* reads where the RX channels were not aligned */
+    CNT_RX_SHORT,           /* reads that could not be completed in time */
+    CNT_RX_CLIP,            /* RX scalars at ADC full scale */
+    CNT_RX_RING_FULL,       /* RX pump blocks dropped, the reader fell behind */
+    CNT_RX_REC_DROPPED,     /* RX blocks not recorded, the recorder fell behind */
+    CNT_DEV_DRIFT,          /* board timestamp realignments */
+    CNT_COUNT,
+};
+
+static const char * const trx_lms_counter_names[CNT_COUNT] = {
+    "tx_underrun", "tx_dropped", "tx_late", "tx_misaligned", "tx_uplink",
+    "tx_clip", "tx_queue_full", "tx_partial", "tx_rec_dropped", "rx_overrun",
+    "rx_dropped", "rx_gap", "rx_fill", "rx_trim", "rx_skew", "rx_short",
+    "rx_clip", "rx_ring_full", "rx_rec_dropped", "dev_drift",
+};
+
+struct alignas(64) TRXLmsCounter {
+    std::atomic<int64_t> val;
+};
+
+/* Single writer increment */
+static inline void trx_lms_count(TRXLmsCounter *c, int64_t n = 1)
+{
+    c->val.store(c->val.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline int64_t trx_lms_counter(const TRXLmsCounter *c)
+{
+    return c->val.load(std::memory_order_relaxed);
+}
+
+#ifdef TRX_LMS_PROFILE
+/* Log-linear latency histogram (HDR style): values below 2^HIST_SUB_BITS
+ * have their own bucket, above that each power of two is split in
+ * 2^HIST_SUB_BITS buckets, i.e. about 6% resolution from ns to minutes.
+ * Single writer, read racily by trx_dump_info. */
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    (60 * HIST_SUB)   /* covers all positive int64_t */
+
+enum {
+    PROF_CALL,              /* whole read/write call */
+    PROF_IO,                /* inside LMS_RecvStream/LMS_SendStream */
+    PROF_CONV,              /* sample conversion */
+    PROF_GAP,               /* from the end of the previous call */
+    PROF_COUNT,
+};
+
+static const char * const trx_lms_prof_names[PROF_COUNT] = {
+    "call", "io", "conv", "gap",
+};
+
+struct TRXLmsHist {
+    std::atomic<uint64_t> count;
+    std::atomic<int64_t> max;
+    std::atomic<uint32_t> bucket[HIST_BUCKETS];
+};
+
+struct alignas(64) TRXLmsProf {
+    int64_t last;           /* end of the previous call, ns */
+    TRXLmsHist hist[PROF_COUNT];
+};
+#endif
+
+/* One RF port: a group of consecutive channels with its own streams,
+ * buffers, sample rate, counters and profile. The eNB reads and writes
+ * each port from its own threads, so ports never share hot state. */
+#define TDD_MAX_BURST   10
+
+/* TDD downlink pattern of a port, from the cell configuration. The frame
+ * phase is not known to the driver: it is locked from the timestamps at
+ * which LTEENB starts its TX bursts. */
+struct TRXLmsTdd {
+    int64_t period;                     /* samples, 0: FDD */
+    int burst_count;
+    int64_t dl_start[TDD_MAX_BURST];    /* downlink bursts in the period; */
+    int64_t dl_end[TDD_MAX_BURST];      /* an end may be beyond the period */
+    bool gate;                          /* do not send outside the bursts */
+
+    /* TX thread only */
+    int cand_count;
+    int64_t cand[TDD_MAX_BURST];        /* frame phases still possible */
+    int64_t phase;                      /* -1 until locked */
+    int64_t tx_end;                     /* after the last write, -1 after a burst end,
+                                           TDD_NO_WRITE before the first write */
+};
+
+#define TDD_NO_WRITE    INT64_MIN
+
+/* Sample ring between a port and its RX pump or TX writer thread, single
+ * producer single consumer. Slots hold up to 'block' samples of every
+ * channel in the stream format with their timestamp; the slot after the
+ * last is the scratch area the RX pump drains USB into while full. */
+struct TRXLmsRing {
+    int slots;                          /* power of two */
+    int block;                          /* samples per slot */
+    int ssize;                          /* bytes per sample */
+    int nch;
+    size_t stride;                      /* bytes per channel in a slot */
+    uint8_t *mem;
+    trx_timestamp_t *ts;
+    int *len;
+    bool *flags;                        /* TX: flush the packet after the slot */
+    int event;                          /* eventfd, wakes a waiting consumer */
+    int space_event;                    /* eventfd, wakes a producer waiting for a slot */
+    std::atomic<int> error;             /* producer failure */
+
+    alignas(64) std::atomic<uint64_t> head;     /* producer */
+    std::atomic<int64_t> depth_max;
+    alignas(64) std::atomic<uint64_t> tail;     /* consumer */
+    int offset;                                 /* samples consumed in slot tail */
+    std::atomic<bool> waiting;
+    std::atomic<bool> space_waiting;
+};
+
+struct alignas(64) TRXLmsPort {
+    int index;
+    int rx_ch0;             /* first RX channel of the port */
+    int rx_count;
+    int tx_ch0;             /* first TX channel of the port */
+    int tx_count;
+    int sample_rate;
+    lms_stream_t *rx_stream;
+    lms_stream_t *tx_stream;
+    int16_t **tx_buf;
+    int rx_dev[MAX_NUM_CH]; /* board of each channel */
+    int tx_dev[MAX_NUM_CH];
+    const std::atomic<int64_t> *dev_ts_offset;
+    TRXLmsTdd tdd;
+    TRXLmsRing *ring;       /* RX pump, NULL: the read thread receives */
+    pthread_t pump_thread;
+    bool pump_running;
+    TRXLmsRing *txq;        /* TX writer, NULL: the write thread sends */
+    pthread_t writer_thread;
+    bool writer_running;
+    std::atomic<int64_t> tx_margin;     /* queued timestamp - board time at send */
+    std::atomic<int64_t> tx_margin_min;
+    const std::atomic<bool> *io_stop;
+
+    /* TX coalescing, owned by the thread calling LMS_SendStream: the tail
+     * of the last send short of a device packet, waiting for the next */
+    int tx_spp;             /* device packet in samples per channel, 0: off */
+    int tx_pend_lead;       /* flush when board time gets this close, in samples */
+    uint8_t *tx_pend[MAX_NUM_CH];
+    trx_timestamp_t tx_pend_ts;
+    int tx_pend_len;
+
+    /* RX gap filling, owned by the thread calling LMS_RecvStream */
+    int rx_fill_max;        /* longest gap zero-filled, in samples, 0: off */
+    uint8_t *rx_carry[MAX_NUM_CH];  /* received samples a fill pushed past the end of a read */
+    trx_timestamp_t rx_carry_ts;
+    int rx_carry_len;
+
+    /* IQ recorder: samples as received from / sent to LimeSuite, copied
+     * by the streaming threads while a recording of the port is on */
+    TRXLmsRing *rec[2];     /* 0: RX, 1: TX, NULL: no recorder */
+    std::atomic<bool> rec_on;
+
+    /* written by the RX thread, read by the TX thread */
+    alignas(64) std::atomic<int64_t> rx_ts_next;  /* timestamp after the last received sample */
+    std::atomic<int64_t> hw_offset;     /* board timestamp - host time in samples, INT64_MIN: unknown */
+    double hw_offset_f;                 /* RX thread only */
+    int64_t hw_update_ns;
+    std::atomic<int64_t> rx_lead;       /* board time ahead of rx_ts_next, from the control thread */
+    alignas(64) TRXLmsCounter cnt[CNT_COUNT];
+#ifdef TRX_LMS_PROFILE
+    TRXLmsProf rx_prof;
+    TRXLmsProf tx_prof;
+#endif
+};
+
+/* RX snapshot requested over the message API. Armed by the control
+ * thread, filled by the RX thread of 'port'; 'busy' counts the RX threads
+ * looking at it, the control thread waits for zero before freeing. */
+struct TRXLmsSnapshot {
+    std::atomic<int> armed;
+    std::atomic<int> busy;
+    std::atomic<int> port;
+    int count;
+    int filled;
+    trx_timestamp_t timestamp;
+    float *buf[MAX_NUM_CH];
+};
+
+typedef struct TRXLmsJob TRXLmsJob;
+
+/* Recording in progress, set up by the control thread and then owned by
+ * the recorder thread until rec_active is cleared. One SigMF recording
+ * per channel and direction, the data file mapped in memory. */
+struct TRXLmsRecord {
+    int port;
+    int64_t samples;            /* per recording */
+    int64_t deadline;           /* us */
+    char file[256];
+    char datetime[32];
+    int nch[2];
+    int fd[2][MAX_NUM_CH];
+    uint8_t *map[2][MAX_NUM_CH];
+    trx_timestamp_t start[2];   /* timestamp of sample 0, -1 until the first block */
+    int64_t written[2];         /* samples covered from 'start' */
+    double freq[2];             /* LO frequencies when it started */
+};
+
+/* SX registers of one retune_freqs entry on one board */
+struct TRXLmsTune {
+    uint16_t sx[2][SX_REG_COUNT];   /* SXR, SXT */
+};
+
 struct TRXLmsState {
-    lms_device_t *device;
+    /* Driver channel 'ch' is channel ch % rx_dev_ch (tx_dev_ch for TX)
+       of board ch / rx_dev_ch */
+    lms_device_t *devices[MAX_NUM_DEV];
+    int device_count;
+    int rx_dev_ch;
+    int tx_dev_ch;
+    int sync_tolerance;
+    bool tdd_gating;
+    /* board timestamp = driver timestamp + offset, board 0 is the reference */
+    std::atomic<int64_t> dev_ts_offset[MAX_NUM_DEV];
     lms_stream_t rx_stream[MAX_NUM_CH];
     lms_stream_t tx_stream[MAX_NUM_CH];
     int tcxo_calc;          /* values from 0 to 255*/
     int dec_inter;
-    int started;
+    std::atomic<int> started;
+    pthread_mutex_t start_lock;
     int sample_rate;
     int tx_channel_count;
     int rx_channel_count;
     int calibrate;
+    char *cal_cache;        /* calibration cache directory, NULL if disabled */
+    LmsImageReg *image;     /* registers of the loaded binary image */
+    int image_count;
+    int cal_max_age;        /* seconds */
     int ini_file;
     float rx_power;
     float tx_power;
     bool rx_power_available;
     bool tx_power_available;
-};
+    int hugepages;
+
+    /* RX pump and TX writer threads: one per port, optionally pinned and
+       SCHED_FIFO */
+    bool rx_pump;
+    int pump_cpu[MAX_NUM_PORT];         /* -1: not pinned */
+    int pump_prio;                      /* 0: SCHED_OTHER */
+    int pump_ring_ms;
+    bool tx_writer;
+    int writer_cpu[MAX_NUM_PORT];
+    int writer_prio;
+    int writer_queue_ms;
+    bool tx_coalesce;
+    int tx_coalesce_us;
+    int rx_fill_us;
+
+    /* IQ recorder */
+    int rec_ring_ms;                    /* 0: no recorder */
+    pthread_t rec_thread;
+    bool rec_running;
+    std::atomic<bool> rec_active;
+    TRXLmsRecord rec;
+    double rx_freq;                     /* current LO frequencies */
+    double tx_freq;
+
+    /* Retune table, built at start */
+    double tune_freq[RETUNE_MAX];
+    int tune_count;
+    TRXLmsTune *tune;                   /* [board][tune_count], NULL if not built */
+    std::atomic<bool> io_stop;
 
+    /* Digital gain per channel (linear), folded into the sample conversion.
+       Gain changes within dgain_range dB of the RF gain only touch it. */
+    std::atomic<float> rx_dgain[MAX_NUM_CH];
+    std::atomic<float> tx_dgain[MAX_NUM_CH];
+    double rx_rf_gain[MAX_NUM_CH];      /* dB programmed in the LMS7002M */
+    double tx_rf_gain[MAX_NUM_CH];
+    double dgain_range;
+
+    /* stream FIFO: fixed from the config, or chosen from the sample rate
+       and link and adapted to the errors seen. LimeSuite only takes them
+       at stream setup, adapted values are for the next start. */
+    enum { FIFO_FIXED, FIFO_AUTO } fifo_mode;
+    char link[16];
+    int fifo_size;
+    float fifo_tvl;
+    int fifo_next_size;
+    float fifo_next_tvl;
+    char *fifo_state_file;
+    int64_t fifo_errors;
+    int fifo_warmup;
+    int fifo_quiet_ticks;
+    float fifo_fill_max;
+
+    /* TX conversion buffers, carved from one locked pool in start */
+    void *buf_pool;
+    size_t buf_pool_size;
+    bool buf_pool_huge;
+    int buf_samples;        /* per channel capacity, in complex samples */
+    int16_t *tx_buf[MAX_NUM_CH];
+
+    int port_count;
+    TRXLmsPort port[MAX_NUM_PORT];
+
+    /* control thread, serves the message API and gain changes off the
+       streaming threads; runs from the end of trx_start to trx_end so
+       that it never races trx_start on the SPI */
+    pthread_t ctrl_thread;
+    pthread_mutex_t ctrl_lock;
+    int ctrl_event;                     /* eventfd, wakes the control thread */
+    std::atomic<bool> ctrl_running;
+    std::atomic<bool> ctrl_stop;
+    TRXLmsJob *ctrl_jobs;
+    TRXLmsJob *capture_job;             /* armed snapshot, control thread only */
+    /* latest requested gain per channel, NAN when none is pending */
+    std::atomic<double> rx_gain_req[MAX_NUM_CH];
+    std::atomic<double> tx_gain_req[MAX_NUM_CH];
+    std::atomic<int> gain_coalesced;
+    TRXLmsSnapshot snapshot;
+};
 
-int16_t* tx_buffers[MAX_NUM_CH] = {0};
-int16_t* rx_buffers[MAX_NUM_CH] = {0};
 
 static int64_t trx_lms_t0 = 0;
 
@@ -56,6 +419,361 @@ static int64_t get_time_us(void)
     return (int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec / 1000U) - trx_lms_t0;
 }
 
+/*
+ * Sample conversion kernels.
+ * 'n' is the number of scalars (2 per complex sample). The scalar versions
+ * are the reference: every SIMD variant must give bit-identical results.
+ * float -> int16 truncates toward zero as the plain cast did, but saturates
+ * to [-max-1, max] instead of wrapping (NaN maps to max, like minps).
+ * 'scale' carries the digital gain. Both directions return the number of
+ * clipped scalars: int16 inputs at or beyond +/-clip (ADC full scale), or
+ * float inputs saturated by the conversion.
+ * int16 -> float also runs in place, 'src' being the upper half of 'dst':
+ * kernels load a block before storing it and take no restrict pointers.
+ */
+typedef int (*trx_lms_i16_to_f32_func)(float *dst, const int16_t *src, int n, float scale, int clip);
+typedef int (*trx_lms_f32_to_i16_func)(int16_t *dst, const float *src, int n, float scale, float max);
+
+static int trx_lms_i16_to_f32_c(float *dst, const int16_t *src, int n, float scale, int clip)
+{
+    int clipped = 0;
+    for (int i = 0; i < n; i++) {
+        int16_t v = src[i];     /* dst[i] may overlap src[i] in place */
+        clipped += v >= clip || v < -clip;
+        dst[i] = v * scale;
+    }
+    return clipped;
+}
+
+static int trx_lms_f32_to_i16_c(int16_t *dst, const float *src, int n, float scale, float max)
+{
+    const float min = -max - 1.0f;
+    int clipped = 0;
+    for (int i = 0; i < n; i++) {
+        float v = src[i] * scale;
+        clipped += v > max || v < min;
+        v = v < max ? v : max;
+        v = v > min ? v : min;
+        dst[i] = (int16_t)v;
+    }
+    return clipped;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int trx_lms_i16_to_f32_sse2(float *dst, const int16_t *src, int n, float scale, int clip)
+{
+    const __m128 k = _mm_set1_ps(scale);
+    const __m128i hi = _mm_set1_epi16(clip - 1);
+    const __m128i lo = _mm_set1_epi16(-clip);
+    int clipped = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i c = _mm_or_si128(_mm_cmpgt_epi16(x, hi), _mm_cmplt_epi16(x, lo));
+        clipped += __builtin_popcount(_mm_movemask_epi8(c)) / 2;
+        __m128i l = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i h = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(l), k));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(h), k));
+    }
+    return clipped + trx_lms_i16_to_f32_c(dst + i, src + i, n - i, scale, clip);
+}
+
+__attribute__((target("sse2")))
+static int trx_lms_f32_to_i16_sse2(int16_t *dst, const float *src, int n, float scale, float max)
+{
+    const __m128 k = _mm_set1_ps(scale);
+    const __m128 vmax = _mm_set1_ps(max);
+    const __m128 vmin = _mm_set1_ps(-max - 1.0f);
+    int clipped = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), k);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), k);
+        clipped += __builtin_popcount(_mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(a, vmax), _mm_cmplt_ps(a, vmin))) |
+                                      _mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(b, vmax), _mm_cmplt_ps(b, vmin))) << 4);
+        a = _mm_max_ps(_mm_min_ps(a, vmax), vmin);
+        b = _mm_max_ps(_mm_min_ps(b, vmax), vmin);
+        _mm_storeu_si128((__m128i*)(dst + i),
+                         _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b)));
+    }
+    return clipped + trx_lms_f32_to_i16_c(dst + i, src + i, n - i, scale, max);
+}
+
+__attribute__((target("avx2")))
+static int trx_lms_i16_to_f32_avx2(float *dst, const int16_t *src, int n, float scale, int clip)
+{
+    const __m256 k = _mm256_set1_ps(scale);
+    const __m256i hi = _mm256_set1_epi16(clip - 1);
+    const __m256i lo = _mm256_set1_epi16(-clip);
+    int clipped = 0;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i c = _mm256_or_si256(_mm256_cmpgt_epi16(x, hi), _mm256_cmpgt_epi16(lo, x));
+        clipped += __builtin_popcount(_mm256_movemask_epi8(c)) / 2;
+        __m256i l = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+        __m256i h = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), k));
+        _mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(h), k));
+    }
+    return clipped + trx_lms_i16_to_f32_sse2(dst + i, src + i, n - i, scale, clip);
+}
+
+__attribute__((target("avx2")))
+static int trx_lms_f32_to_i16_avx2(int16_t *dst, const float *src, int n, float scale, float max)
+{
+    const __m256 k = _mm256_set1_ps(scale);
+    const __m256 vmax = _mm256_set1_ps(max);
+    const __m256 vmin = _mm256_set1_ps(-max - 1.0f);
+    int clipped = 0;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), k);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), k);
+        clipped += __builtin_popcount(
+            _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(a, vmax, _CMP_GT_OQ), _mm256_cmp_ps(a, vmin, _CMP_LT_OQ))) |
+            _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(b, vmax, _CMP_GT_OQ), _mm256_cmp_ps(b, vmin, _CMP_LT_OQ))) << 8);
+        a = _mm256_max_ps(_mm256_min_ps(a, vmax), vmin);
+        b = _mm256_max_ps(_mm256_min_ps(b, vmax), vmin);
+        /* packs works per 128-bit lane, restore sample order */
+        __m256i r = _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(r, 0xd8));
+    }
+    return clipped + trx_lms_f32_to_i16_sse2(dst + i, src + i, n - i, scale, max);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int trx_lms_i16_to_f32_avx512(float *dst, const int16_t *src, int n, float scale, int clip)
+{
+    const __m512 k = _mm512_set1_ps(scale);
+    const __m512i hi = _mm512_set1_epi32(clip - 1);
+    const __m512i lo = _mm512_set1_epi32(-clip);
+    int clipped = 0;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i x = _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(src + i)));
+        clipped += __builtin_popcount(_mm512_cmpgt_epi32_mask(x, hi) | _mm512_cmplt_epi32_mask(x, lo));
+        _mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_cvtepi32_ps(x), k));
+    }
+    return clipped + trx_lms_i16_to_f32_avx2(dst + i, src + i, n - i, scale, clip);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int trx_lms_f32_to_i16_avx512(int16_t *dst, const float *src, int n, float scale, float max)
+{
+    const __m512 k = _mm512_set1_ps(scale);
+    const __m512 vmax = _mm512_set1_ps(max);
+    const __m512 vmin = _mm512_set1_ps(-max - 1.0f);
+    int clipped = 0;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 a = _mm512_mul_ps(_mm512_loadu_ps(src + i), k);
+        clipped += __builtin_popcount(_mm512_cmp_ps_mask(a, vmax, _CMP_GT_OQ) | _mm512_cmp_ps_mask(a, vmin, _CMP_LT_OQ));
+        a = _mm512_max_ps(_mm512_min_ps(a, vmax), vmin);
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm512_cvtsepi32_epi16(_mm512_cvttps_epi32(a)));
+    }
+    return clipped + trx_lms_f32_to_i16_avx2(dst + i, src + i, n - i, scale, max);
+}
+#endif
+
+#if defined(__aarch64__)
+static int trx_lms_i16_to_f32_neon(float *dst, const int16_t *src, int n, float scale, int clip)
+{
+    const int16x8_t hi = vdupq_n_s16(clip - 1);
+    const int16x8_t lo = vdupq_n_s16(-clip);
+    uint32x4_t acc = vdupq_n_u32(0);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t x = vld1q_s16(src + i);
+        uint16x8_t c = vorrq_u16(vcgtq_s16(x, hi), vcltq_s16(x, lo));
+        acc = vpadalq_u16(acc, vshrq_n_u16(c, 15));
+        vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), scale));
+        vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), scale));
+    }
+    return vaddvq_u32(acc) + trx_lms_i16_to_f32_c(dst + i, src + i, n - i, scale, clip);
+}
+
+static int trx_lms_f32_to_i16_neon(int16_t *dst, const float *src, int n, float scale, float max)
+{
+    const float32x4_t vmax = vdupq_n_f32(max);
+    const float32x4_t vmin = vdupq_n_f32(-max - 1.0f);
+    uint32x4_t acc = vdupq_n_u32(0);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t a = vmulq_n_f32(vld1q_f32(src + i), scale);
+        float32x4_t b = vmulq_n_f32(vld1q_f32(src + i + 4), scale);
+        /* all ones compare results: subtracting counts one per lane */
+        acc = vsubq_u32(acc, vorrq_u32(vcgtq_f32(a, vmax), vcltq_f32(a, vmin)));
+        acc = vsubq_u32(acc, vorrq_u32(vcgtq_f32(b, vmax), vcltq_f32(b, vmin)));
+        /* vminnm/vmaxnm return the number for NaN inputs, as the reference */
+        a = vmaxnmq_f32(vminnmq_f32(a, vmax), vmin);
+        b = vmaxnmq_f32(vminnmq_f32(b, vmax), vmin);
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(vcvtq_s32_f32(a)), vqmovn_s32(vcvtq_s32_f32(b))));
+    }
+    return vaddvq_u32(acc) + trx_lms_f32_to_i16_c(dst + i, src + i, n - i, scale, max);
+}
+#endif
+
+static struct {
+    const char *name;
+    trx_lms_i16_to_f32_func i16_to_f32;
+    trx_lms_f32_to_i16_func f32_to_i16;
+} trx_lms_conv = { "scalar", trx_lms_i16_to_f32_c, trx_lms_f32_to_i16_c };
+
+/* Select the conversion kernels from CPU features. 'force' (may be NULL)
+   restricts the choice to a given kernel set, "scalar" disables SIMD. */
+static void trx_lms_conv_init(const char *force)
+{
+    bool any = !force || !strcasecmp(force, "auto");
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if ((any || !strcasecmp(force, "avx512")) &&
+        __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        trx_lms_conv.name = "avx512";
+        trx_lms_conv.i16_to_f32 = trx_lms_i16_to_f32_avx512;
+        trx_lms_conv.f32_to_i16 = trx_lms_f32_to_i16_avx512;
+    } else if ((any || !strcasecmp(force, "avx2")) && __builtin_cpu_supports("avx2")) {
+        trx_lms_conv.name = "avx2";
+        trx_lms_conv.i16_to_f32 = trx_lms_i16_to_f32_avx2;
+        trx_lms_conv.f32_to_i16 = trx_lms_f32_to_i16_avx2;
+    } else if ((any || !strcasecmp(force, "sse2")) && __builtin_cpu_supports("sse2")) {
+        trx_lms_conv.name = "sse2";
+        trx_lms_conv.i16_to_f32 = trx_lms_i16_to_f32_sse2;
+        trx_lms_conv.f32_to_i16 = trx_lms_f32_to_i16_sse2;
+    } else
+#elif defined(__aarch64__)
+    if (any || !strcasecmp(force, "neon")) {
+        trx_lms_conv.name = "neon";
+        trx_lms_conv.i16_to_f32 = trx_lms_i16_to_f32_neon;
+        trx_lms_conv.f32_to_i16 = trx_lms_f32_to_i16_neon;
+    } else
+#endif
+    {
+        trx_lms_conv.name = "scalar";
+        trx_lms_conv.i16_to_f32 = trx_lms_i16_to_f32_c;
+        trx_lms_conv.f32_to_i16 = trx_lms_f32_to_i16_c;
+    }
+    printf("Sample conversion: %s\n", trx_lms_conv.name);
+}
+
+/* F32 format: digital gain in place on received samples, counting
+   scalars at ADC full scale (LimeSuite gives int12 / 2048) */
+static int trx_lms_f32_rx_gain(float *buf, int n, float gain)
+{
+    const float hi = 2047.0f / 2048.0f;
+    int clipped = 0;
+    for (int i = 0; i < n; i++) {
+        clipped += buf[i] >= hi || buf[i] <= -1.0f;
+        buf[i] *= gain;
+    }
+    return clipped;
+}
+
+/* F32 format: gain and saturation to [-1, 1] before LimeSuite, which
+   would wrap larger values */
+static int trx_lms_f32_tx_gain(float *dst, const float *src, int n, float gain)
+{
+    int clipped = 0;
+    for (int i = 0; i < n; i++) {
+        float v = src[i] * gain;
+        clipped += v > 1.0f || v < -1.0f;
+        v = v < 1.0f ? v : 1.0f;
+        dst[i] = v > -1.0f ? v : -1.0f;
+    }
+    return clipped;
+}
+
+static inline int64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - trx_lms_t0 * 1000;
+}
+
+static inline int trx_lms_dev_index(const TRXLmsState *s, bool tx, int ch)
+{
+    return ch / (tx ? s->tx_dev_ch : s->rx_dev_ch);
+}
+
+static inline lms_device_t *trx_lms_dev(const TRXLmsState *s, bool tx, int ch)
+{
+    return s->devices[trx_lms_dev_index(s, tx, ch)];
+}
+
+/* Channel number on the board */
+static inline int trx_lms_chan(const TRXLmsState *s, bool tx, int ch)
+{
+    return ch % (tx ? s->tx_dev_ch : s->rx_dev_ch);
+}
+
+#ifdef TRX_LMS_PROFILE
+static inline void trx_lms_hist_add(TRXLmsHist *h, int64_t v)
+{
+    int idx;
+
+    if (v < 0)
+        v = 0;
+    if (v < HIST_SUB) {
+        idx = v;
+    } else {
+        int msb = 63 - __builtin_clzll(v);
+        idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)(v >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+    }
+    h->bucket[idx].store(h->bucket[idx].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h->count.store(h->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (v > h->max.load(std::memory_order_relaxed))
+        h->max.store(v, std::memory_order_relaxed);
+}
+
+/* Lowest value falling into bucket 'idx' */
+static int64_t trx_lms_hist_value(int idx)
+{
+    int e = idx / HIST_SUB, m = idx % HIST_SUB;
+    return e == 0 ? m : (int64_t)(HIST_SUB + m) << (e - 1);
+}
+
+/* Upper bound of the bucket holding the 'q' quantile */
+static int64_t trx_lms_hist_quantile(const TRXLmsHist *h, double q)
+{
+    uint64_t n = h->count.load(std::memory_order_relaxed);
+    uint64_t target = (uint64_t)ceil(q * n), sum = 0;
+
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        sum += h->bucket[i].load(std::memory_order_relaxed);
+        if (sum >= target && i + 1 < HIST_BUCKETS) {
+            int64_t v = trx_lms_hist_value(i + 1);
+            int64_t max = h->max.load(std::memory_order_relaxed);
+            return v < max ? v : max;
+        }
+    }
+    return h->max.load(std::memory_order_relaxed);
+}
+
+/* t0/t1: entry and exit of the call, io/conv: durations or < 0 if none */
+static inline void trx_lms_prof_call(TRXLmsProf *p, int64_t t0, int64_t io, int64_t conv, int64_t t1)
+{
+    trx_lms_hist_add(&p->hist[PROF_CALL], t1 - t0);
+    if (io >= 0)
+        trx_lms_hist_add(&p->hist[PROF_IO], io);
+    if (conv >= 0)
+        trx_lms_hist_add(&p->hist[PROF_CONV], conv);
+    if (p->last)
+        trx_lms_hist_add(&p->hist[PROF_GAP], t0 - p->last);
+    p->last = t1;
+}
+
+#define PROF_NOW()                      get_time_ns()
+#define PROF_CALL(p, t0, io, conv, t1)  trx_lms_prof_call(p, t0, io, conv, t1)
+#else
+#define PROF_NOW()                      0
+#define PROF_CALL(p, t0, io, conv, t1)  ((void)(t0), (void)(io), (void)(conv), (void)(t1))
+#endif
+
 void LogHandler(int lvl, const char *msg)
 {
     if (lvl <= LMS_LOG_ERROR) {
@@ -66,9 +784,91 @@ void LogHandler(int lvl, const char *msg)
     printf("%s\n", msg);
 }
 
+static void trx_lms7002m_ctrl_end(TRXLmsState *s);
+static void trx_lms7002m_pump_end(TRXLmsState *s);
+static void trx_lms7002m_writer_end(TRXLmsState *s);
+static void trx_lms7002m_coalesce_free(TRXLmsPort *p);
+static void trx_lms7002m_fill_free(TRXLmsPort *p);
+static void trx_lms7002m_rec_end(TRXLmsState *s);
+static void trx_lms7002m_shadow_save(TRXLmsState *s);
+static void trx_lms7002m_rec_put(TRXLmsPort *p, int dir, void **bufs, size_t off, trx_timestamp_t ts, int n);
+
+/* Copy samples to the recorder if a recording of the port is on */
+static inline void trx_lms7002m_record(TRXLmsPort *p, int dir, void **bufs, size_t off, trx_timestamp_t ts, int n)
+{
+    if (p->rec[dir] && p->rec_on.load(std::memory_order_relaxed))
+        trx_lms7002m_rec_put(p, dir, bufs, off, ts, n);
+}
+
+/* Allocate the TX conversion buffers before streaming starts: 64 byte
+ * aligned, optionally on hugepages, locked and prefaulted so that the
+ * first subframes take neither page faults nor allocations. RX needs
+ * none, int16 samples are expanded in the caller's buffers. */
+static int trx_lms7002m_alloc_buffers(TRXLmsState *s, int samples)
+{
+    size_t ssize = s->tx_stream[0].dataFmt == lms_stream_t::LMS_FMT_F32 ? 2 * sizeof(float) : 2 * sizeof(int16_t);
+    size_t chan_size = ((size_t)samples * ssize + 63) & ~(size_t)63;
+    size_t size = chan_size * s->tx_channel_count;
+    uint8_t *p;
+
+    s->buf_pool = NULL;
+    if (s->hugepages) {
+        size_t hsize = (size + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+        void *m = mmap(NULL, hsize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (m != MAP_FAILED) {
+            s->buf_pool = m;
+            s->buf_pool_size = hsize;
+            s->buf_pool_huge = true;
+        } else {
+            fprintf(stderr, "No hugepages available for sample buffers, using normal pages\n");
+        }
+    }
+    if (!s->buf_pool) {
+        if (posix_memalign(&s->buf_pool, 64, size) != 0) {
+            s->buf_pool = NULL;
+            fprintf(stderr, "Cannot allocate sample buffers\n");
+            return -1;
+        }
+        s->buf_pool_size = size;
+        s->buf_pool_huge = false;
+    }
+    if (mlock(s->buf_pool, s->buf_pool_size) != 0)
+        fprintf(stderr, "Cannot lock sample buffers in memory\n");
+    memset(s->buf_pool, 0, s->buf_pool_size);
+
+    p = (uint8_t*)s->buf_pool;
+    for (int ch = 0; ch < s->tx_channel_count; ch++, p += chan_size)
+        s->tx_buf[ch] = (int16_t*)p;
+    s->buf_samples = samples;
+    printf("Sample buffers: %d samples/channel, %zu kB%s\n",
+           samples, s->buf_pool_size / 1024, s->buf_pool_huge ? " on hugepages" : "");
+    return 0;
+}
+
+static void trx_lms7002m_free_buffers(TRXLmsState *s)
+{
+    if (!s->buf_pool)
+        return;
+    munlock(s->buf_pool, s->buf_pool_size);
+    if (s->buf_pool_huge)
+        munmap(s->buf_pool, s->buf_pool_size);
+    else
+        free(s->buf_pool);
+    s->buf_pool = NULL;
+}
+
 static void trx_lms7002m_end(TRXState *s1)
 {
     TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    trx_lms7002m_ctrl_end(s);
+    trx_lms7002m_pump_end(s);
+    trx_lms7002m_writer_end(s);
+    trx_lms7002m_rec_end(s);
+    for (int i = 0; i < s->port_count; i++) {
+        trx_lms7002m_coalesce_free(&s->port[i]);
+        trx_lms7002m_fill_free(&s->port[i]);
+    }
     for (int ch = 0; ch < s->rx_channel_count; ch++)
 	LMS_StopStream(&s->rx_stream[ch]);
 
@@ -76,390 +876,3370 @@ static void trx_lms7002m_end(TRXState *s1)
 	LMS_StopStream(&s->tx_stream[ch]);
 
     for (int ch = 0; ch < s->rx_channel_count; ch++)
-	LMS_DestroyStream(s->device,&s->rx_stream[ch]);
+	LMS_DestroyStream(trx_lms_dev(s, LMS_CH_RX, ch),&s->rx_stream[ch]);
 
     for (int ch = 0; ch < s->tx_channel_count; ch++)
-	LMS_DestroyStream(s->device,&s->tx_stream[ch]);
+	LMS_DestroyStream(trx_lms_dev(s, LMS_CH_TX, ch),&s->tx_stream[ch]);
 
-    LMS_Close(s->device);
-    for (int ch = 0; ch < s->rx_channel_count; ch++)
-        if (rx_buffers[ch]) delete [] rx_buffers[ch];
-    for (int ch = 0; ch < s->tx_channel_count; ch++)
-        if (tx_buffers[ch]) delete [] tx_buffers[ch];
+    trx_lms7002m_shadow_save(s);
+    for (int i = 0; i < s->device_count; i++)
+        LMS_Close(s->devices[i]);
+    trx_lms7002m_free_buffers(s);
+    free(s->fifo_state_file);
+    free(s->cal_cache);
+    free(s->image);
+    free(s->tune);
     free(s);
 }
 
-static void trx_lms7002m_write(TRXState *s1, trx_timestamp_t timestamp,
-                               const void **samples, int count, int flags,
-                               int rf_port_index)
+static int trx_lms_sample_size(const lms_stream_t *stream)
 {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    return stream->dataFmt == lms_stream_t::LMS_FMT_F32 ? 2*sizeof(float) : 2*sizeof(int16_t);
+}
 
-    // Nothing to transmit
-    if (!samples)
-        return;
-    lms_stream_meta_t meta;
-    meta.waitForTimestamp = true;
-    meta.flushPartialPacket = (flags&TRX_WRITE_FLAG_END_OF_BURST);
-    meta.timestamp = timestamp;
+static void trx_lms7002m_fold_status(TRXLmsPort *p, bool tx, const lms_stream_status_t *st);
 
-    for (int ch = 0; ch < s->tx_channel_count; ch++)
-    	LMS_SendStream(&s->tx_stream[ch],(const void*)samples[ch],count,&meta,30);
+/* Port owning an RX channel */
+static TRXLmsPort *trx_lms7002m_rx_port(TRXLmsState *s, int ch)
+{
+    for (int i = 0; i < s->port_count; i++)
+        if (ch >= s->port[i].rx_ch0 && ch < s->port[i].rx_ch0 + s->port[i].rx_count)
+            return &s->port[i];
+    return &s->port[0];
 }
 
-static int trx_lms7002m_read(TRXState *s1, trx_timestamp_t *ptimestamp, void **psamples, int count, int port)
+static int trx_lms_cmp64(const void *a, const void *b)
 {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
-    lms_stream_meta_t meta;
-    meta.waitForTimestamp = false;
-    meta.flushPartialPacket = false;
-    // First shot ?
-    if (!s->started) {
-    	for (int ch = 0; ch < s->rx_channel_count; ch++)
-		LMS_StartStream(&s->rx_stream[ch]);
-    	for (int ch = 0; ch < s->tx_channel_count; ch++)
-		LMS_StartStream(&s->tx_stream[ch]);
-        s->started = 1;
-        printf("START\n");
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Each board counts samples from its own stream start. Estimate the
+ * timestamp offset of board 'b' to board 0 from the stream status: each
+ * measure brackets the board read between two board 0 reads, the median
+ * rejects USB latency outliers. Return < 0 if no timestamp is moving. */
+static int trx_lms7002m_measure_offset(TRXLmsState *s, int b, int64_t *poffset)
+{
+    int dev_ch = b * s->rx_dev_ch;
+    lms_stream_t *ref = &s->rx_stream[0];
+    lms_stream_t *dev = &s->rx_stream[dev_ch];
+    TRXLmsPort *ref_port = trx_lms7002m_rx_port(s, 0);
+    TRXLmsPort *dev_port = trx_lms7002m_rx_port(s, dev_ch);
+    lms_stream_status_t st0, st1, st2;
+    int64_t d[SYNC_MEASURES];
+
+    for (int i = 0; i < SYNC_MEASURES; i++) {
+        if (LMS_GetStreamStatus(ref, &st0) != 0 ||
+            LMS_GetStreamStatus(dev, &st1) != 0 ||
+            LMS_GetStreamStatus(ref, &st2) != 0)
+            return -1;
+        /* the status query clears the stream error counts */
+        trx_lms7002m_fold_status(ref_port, false, &st0);
+        trx_lms7002m_fold_status(dev_port, false, &st1);
+        trx_lms7002m_fold_status(ref_port, false, &st2);
+        if (!st0.timestamp || !st1.timestamp)
+            return -1;
+        d[i] = (int64_t)st1.timestamp - (int64_t)(st0.timestamp + st2.timestamp) / 2;
+    }
+    qsort(d, SYNC_MEASURES, sizeof(d[0]), trx_lms_cmp64);
+    *poffset = d[SYNC_MEASURES / 2];
+    return 0;
+}
+
+/* Align the boards at stream start */
+static void trx_lms7002m_align_devices(TRXLmsState *s)
+{
+    for (int b = 1; b < s->device_count; b++) {
+        int64_t off = 0;
+        for (int i = 0; i < 100; i++) {
+            if (trx_lms7002m_measure_offset(s, b, &off) == 0)
+                break;
+            usleep(1000);
+        }
+        s->dev_ts_offset[b].store(off);
+        printf("Board %d: timestamp offset %" PRId64 " samples\n", b, off);
     }
+}
 
-    int ret;
-    for (int ch = 0; ch < s->rx_channel_count; ch++)
-    	ret = LMS_RecvStream(&s->rx_stream[ch],psamples[ch],count,&meta,30);
+/* Called periodically from the control thread: boards drifting apart
+   (e.g. no shared reference clock) are counted and realigned */
+static void trx_lms7002m_check_devices(TRXLmsState *s)
+{
+    if (!s->started.load(std::memory_order_acquire))
+        return;
+    for (int b = 1; b < s->device_count; b++) {
+        int64_t off, cur = s->dev_ts_offset[b].load();
+        if (trx_lms7002m_measure_offset(s, b, &off) != 0)
+            continue;
+        if (llabs(off - cur) > s->sync_tolerance) {
+            s->port[0].cnt[CNT_DEV_DRIFT].val.fetch_add(1);
+            s->dev_ts_offset[b].store(off);
+            fprintf(stderr, "Board %d: timestamp drift of %" PRId64 " samples, realigned\n", b, off - cur);
+        }
+    }
+}
 
-    *ptimestamp = meta.timestamp;
+static void trx_lms7002m_pump_start(TRXLmsState *s);
+static void trx_lms7002m_writer_start(TRXLmsState *s);
 
-    return ret;
+/* All streams are started together by the first read on any port */
+static void trx_lms7002m_start_streams(TRXLmsState *s)
+{
+    pthread_mutex_lock(&s->start_lock);
+    if (!s->started.load()) {
+        for (int ch = 0; ch < s->rx_channel_count; ch++)
+            LMS_StartStream(&s->rx_stream[ch]);
+        for (int ch = 0; ch < s->tx_channel_count; ch++)
+            LMS_StartStream(&s->tx_stream[ch]);
+        if (s->device_count > 1)
+            trx_lms7002m_align_devices(s);
+        if (s->rx_pump)
+            trx_lms7002m_pump_start(s);
+        if (s->tx_writer)
+            trx_lms7002m_writer_start(s);
+        s->started.store(1, std::memory_order_release);
+        printf("START\n");
+    }
+    pthread_mutex_unlock(&s->start_lock);
 }
 
-void trx_lms7002m_write2(TRXState *s, trx_timestamp_t timestamp, const void **samples, int count, int port, TRXWriteMetadata *md)
+/* Host monotonic time in samples of the port */
+static inline double trx_lms_host_samples(const TRXLmsPort *p, int64_t ns)
 {
-    trx_lms7002m_write(s, timestamp, samples, count, md->flags, port);
+    return ns * 1e-9 * p->sample_rate;
 }
-int trx_lms7002m_read2(TRXState *s, trx_timestamp_t *ptimestamp, void **samples, int count, int port, TRXReadMetadata *md)
+
+/* Board clock estimate, as an offset to the host clock. Received data
+ * is never early, so the estimate follows the most advanced arrival; it
+ * decays by the allowed clock drift to also follow a board clock running
+ * slower than the host. Called by the RX thread after each read. */
+static inline void trx_lms7002m_hw_clock_update(TRXLmsPort *p, trx_timestamp_t rx_end)
 {
-    return trx_lms7002m_read(s, ptimestamp, samples, count, port);
+    int64_t now = get_time_ns();
+    double off = rx_end + p->rx_lead.load(std::memory_order_relaxed) - trx_lms_host_samples(p, now);
+
+    if (p->hw_update_ns) {
+        double decayed = p->hw_offset_f -
+            trx_lms_host_samples(p, now - p->hw_update_ns) * HW_CLOCK_SLACK_PPM * 1e-6;
+        if (off < decayed)
+            off = decayed;
+    }
+    p->hw_offset_f = off;
+    p->hw_update_ns = now;
+    p->hw_offset.store((int64_t)off, std::memory_order_relaxed);
 }
 
+/* Return the current board timestamp in *pts, < 0 if not known yet */
+static inline int trx_lms7002m_cur_timestamp(const TRXLmsPort *p, trx_timestamp_t *pts)
+{
+    int64_t off = p->hw_offset.load(std::memory_order_relaxed);
+    if (off == INT64_MIN)
+        return -1;
+    *pts = off + (int64_t)trx_lms_host_samples(p, get_time_ns());
+    return 0;
+}
 
-static void trx_lms7002m_write_int(TRXState *s1, trx_timestamp_t timestamp,
-                               const void **samples, int count, int flags,
-                               int rf_port_index)
+/*
+ * RX gap filling
+ *
+ * After an RX FIFO overflow, LimeSuite resumes at a later timestamp. A
+ * gap of up to rx_gap_fill_us is zero-filled so that the eNB keeps a
+ * continuous stream and only loses the symbols in the gap: the received
+ * samples are shifted by the gap, what no longer fits in the read is
+ * carried over to the next one. Samples older than what was already
+ * delivered are trimmed. Larger gaps are passed on as timestamp jumps.
+ */
+static void trx_lms7002m_carry_take(TRXLmsPort *p, void **bufs, int count, int ssize,
+                                    int *got, trx_timestamp_t *ts)
 {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
-    const float maxValue = s->tx_stream->dataFmt == lms_stream_t::LMS_FMT_I12 ? 2047.0f : 32767.0f;
-    // Nothing to transmit
-    if (!samples)
-        return;
-    lms_stream_meta_t meta;
-    meta.waitForTimestamp = true;
-    meta.flushPartialPacket = false;
-    meta.timestamp = timestamp;
+    int n = p->rx_carry_len < count ? p->rx_carry_len : count;
 
-    for (int ch = 0; ch < s->tx_channel_count; ch++)
-    	for (int i = 0; i < count*2; i++)
-	    tx_buffers[ch][i] = ((const float*)samples[ch])[i]*maxValue;
+    for (int ch = 0; ch < p->rx_count; ch++) {
+        memcpy(bufs[ch], p->rx_carry[ch], n * ssize);
+        if (n < p->rx_carry_len)
+            memmove(p->rx_carry[ch], p->rx_carry[ch] + n * ssize, (p->rx_carry_len - n) * ssize);
+        got[ch] = n;
+        ts[ch] = p->rx_carry_ts;
+    }
+    p->rx_carry_ts += n;
+    p->rx_carry_len -= n;
+}
 
-    for (int ch = 0; ch < s->tx_channel_count; ch++)
-    	LMS_SendStream(&s->tx_stream[ch],(const void*)tx_buffers[ch],count,&meta,30);
+/* 'n' samples at '*pts' were received when 'next' was expected: make
+ * them start at 'next' if possible. Return the samples now in the
+ * buffers. */
+static int trx_lms7002m_resync(TRXLmsPort *p, void **bufs, int count, int ssize, int n,
+                               trx_timestamp_t *pts, trx_timestamp_t next)
+{
+    trx_timestamp_t ts = *pts;
+    int64_t d = ts - next;
+
+    if (d < 0) {
+        int trim = -d < n ? (int)-d : n;
+        for (int ch = 0; ch < p->rx_count; ch++)
+            memmove(bufs[ch], (uint8_t*)bufs[ch] + trim * ssize, (n - trim) * ssize);
+        trx_lms_count(&p->cnt[CNT_RX_TRIM], trim);
+        *pts = next;
+        return n - trim;
+    }
+    if (d > p->rx_fill_max)
+        return n;
+
+    /* keep what is pushed past 'count', ahead of any older carry */
+    int fill = d < count ? (int)d : count;
+    int keep = fill + n - count;
+    if (keep < 0)
+        keep = 0;
+    if (keep + p->rx_carry_len > p->rx_fill_max) {
+        /* would not fit the carry, happens only on repeated gaps */
+        return n;
+    }
+    for (int ch = 0; ch < p->rx_count; ch++) {
+        uint8_t *buf = (uint8_t*)bufs[ch];
+        uint8_t *c = p->rx_carry[ch];
+        if (keep) {
+            memmove(c + keep * ssize, c, p->rx_carry_len * ssize);
+            memcpy(c, buf + (n - keep) * ssize, keep * ssize);
+        }
+        memmove(buf + fill * ssize, buf, (n - keep) * ssize);
+        memset(buf, 0, fill * ssize);
+    }
+    if (keep)
+        p->rx_carry_ts = ts + n - keep;
+    p->rx_carry_len += keep;
+    trx_lms_count(&p->cnt[CNT_RX_FILL], fill);
+    *pts = next;
+    return fill + n - keep;
 }
 
-static int trx_lms7002m_read_int(TRXState *s1, trx_timestamp_t *ptimestamp, void **psamples, int count, int port)
+static int trx_lms7002m_fill_alloc(TRXLmsState *s, TRXLmsPort *p)
 {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
-    const float maxValue = s->rx_stream->dataFmt == lms_stream_t::LMS_FMT_I12 ? 2048.0f : 32768.0f;
-    lms_stream_meta_t meta;
-    meta.waitForTimestamp = false;
-    meta.flushPartialPacket = false;
+    const size_t ssize = trx_lms_sample_size(&p->rx_stream[0]);
 
-    // First shot ?
-    if (!s->started) {
-        for (int ch = 0; ch < s->rx_channel_count; ch++)
-            rx_buffers[ch] = new int16_t[count*2];
-        for (int ch = 0; ch < s->tx_channel_count; ch++)
-            tx_buffers[ch] = new int16_t[count*2];
-    	for (int ch = 0; ch < s->rx_channel_count; ch++)
-		LMS_StartStream(&s->rx_stream[ch]);
-    	for (int ch = 0; ch < s->tx_channel_count; ch++)
-		LMS_StartStream(&s->tx_stream[ch]);
-        s->started = 1;
-        printf("START\n");
+    p->rx_fill_max = (int64_t)p->sample_rate * s->rx_fill_us / 1000000;
+    p->rx_carry_len = 0;
+    if (!p->rx_fill_max)
+        return 0;
+    for (int ch = 0; ch < p->rx_count; ch++) {
+        if (posix_memalign((void**)&p->rx_carry[ch], 64, p->rx_fill_max * ssize) != 0) {
+            p->rx_carry[ch] = NULL;
+            fprintf(stderr, "Cannot allocate RX gap buffers\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void trx_lms7002m_fill_free(TRXLmsPort *p)
+{
+    for (int ch = 0; ch < MAX_NUM_CH; ch++) {
+        free(p->rx_carry[ch]);
+        p->rx_carry[ch] = NULL;
+    }
+    p->rx_fill_max = 0;
+}
+
+/* Receive 'count' samples on every RX channel into bufs[ch].
+ * LimeSuite demultiplexes all channels of a board from the same USB
+ * packets, so rather than giving each LMS_RecvStream() its own timeout the
+ * whole group shares one deadline. Short reads are refilled, and channels
+ * whose first timestamp is behind the others drop their leading samples
+ * until every channel starts on the same timestamp.
+ * Return the number of coherent samples (count unless the deadline was
+ * hit), < 0 on error. */
+static int trx_lms7002m_recv(TRXLmsPort *p, void **bufs, int count, trx_timestamp_t *ptimestamp)
+{
+    const int nch = p->rx_count;
+    const int ssize = trx_lms_sample_size(&p->rx_stream[0]);
+    const int64_t deadline = get_time_us() + STREAM_TIMEOUT_MS * 1000;
+    trx_timestamp_t ts[MAX_NUM_CH];
+    int got[MAX_NUM_CH];
+    bool skew = false, restart = false;
+
+    for (int ch = 0; ch < nch; ch++)
+        got[ch] = 0;
+    if (p->rx_carry_len)
+        trx_lms7002m_carry_take(p, bufs, count, ssize, got, ts);
+
+    for (;;) {
+        for (int ch = 0; ch < nch; ch++) {
+            if (got[ch] >= count)
+                continue;
+            int64_t left = deadline - get_time_us();
+            unsigned timeout = left > 0 ? (left + 999) / 1000 : 0;
+            lms_stream_meta_t meta;
+            meta.waitForTimestamp = false;
+            meta.flushPartialPacket = false;
+            uint8_t *buf = (uint8_t*)bufs[ch];
+            int ret = LMS_RecvStream(&p->rx_stream[ch], buf + got[ch]*ssize, count - got[ch], &meta, timeout);
+            if (ret < 0)
+                return ret;
+            if (ret == 0)
+                continue;
+            trx_timestamp_t mts = (trx_timestamp_t)meta.timestamp -
+                p->dev_ts_offset[p->rx_dev[ch]].load(std::memory_order_relaxed);
+            if (got[ch] == 0) {
+                ts[ch] = mts;
+            } else if (mts != ts[ch] + got[ch]) {
+                int64_t d = mts - (ts[ch] + got[ch]);
+                if (d < 0 && p->rx_fill_max) {
+                    /* samples already received: drop them */
+                    int trim = -d < ret ? (int)-d : ret;
+                    memmove(buf + got[ch]*ssize, buf + (got[ch] + trim)*ssize, (ret - trim)*ssize);
+                    ret -= trim;
+                    if (ch == 0) {
+                        trx_lms_count(&p->cnt[CNT_RX_GAP]);
+                        trx_lms_count(&p->cnt[CNT_RX_TRIM], trim);
+                    }
+                } else if (d > 0 && d <= p->rx_fill_max && got[ch] + d + ret <= count) {
+                    /* lost packets inside the channel: zeros in their place */
+                    memmove(buf + (got[ch] + d)*ssize, buf + got[ch]*ssize, ret*ssize);
+                    memset(buf + got[ch]*ssize, 0, d*ssize);
+                    got[ch] += d;
+                    if (ch == 0) {
+                        trx_lms_count(&p->cnt[CNT_RX_GAP]);
+                        trx_lms_count(&p->cnt[CNT_RX_FILL], d);
+                    }
+                } else {
+                    /* discontinuity inside the channel: restart from the
+                       new data, counted as a gap below */
+                    memmove(buf, buf + got[ch]*ssize, ret*ssize);
+                    ts[ch] = mts;
+                    got[ch] = 0;
+                    if (ch == 0)
+                        restart = true;
+                }
+            }
+            got[ch] += ret;
+        }
+
+        /* align every channel on the latest start timestamp */
+        trx_timestamp_t target = INT64_MIN;
+        for (int ch = 0; ch < nch; ch++)
+            if (got[ch] > 0 && ts[ch] > target)
+                target = ts[ch];
+        bool done = true;
+        for (int ch = 0; ch < nch; ch++) {
+            if (got[ch] > 0 && ts[ch] < target) {
+                int64_t d = target - ts[ch];
+                uint8_t *buf = (uint8_t*)bufs[ch];
+                if (d >= got[ch]) {
+                    got[ch] = 0;
+                } else {
+                    memmove(buf, buf + d*ssize, (got[ch] - d)*ssize);
+                    got[ch] -= d;
+                    ts[ch] = target;
+                }
+                skew = true;
+            }
+            if (got[ch] < count)
+                done = false;
+        }
+        if (done || get_time_us() >= deadline)
+            break;
+    }
+
+    if (skew)
+        trx_lms_count(&p->cnt[CNT_RX_SKEW]);
+
+    int n = count;
+    for (int ch = 0; ch < nch; ch++)
+        if (got[ch] < n)
+            n = got[ch];
+    if (n < count && !p->ring)     /* the pump reader counts its own */
+        trx_lms_count(&p->cnt[CNT_RX_SHORT]);
+    if (n > 0) {
+        int64_t next = p->rx_ts_next.load(std::memory_order_relaxed);
+        trx_timestamp_t end = ts[0] + n;
+        /* once, a restart usually also moved ts[0] away from next */
+        if (restart || (next && ts[0] != next))
+            trx_lms_count(&p->cnt[CNT_RX_GAP]);
+        if (next && ts[0] != next) {
+            if (p->rx_fill_max)
+                n = trx_lms7002m_resync(p, bufs, count, ssize, n, &ts[0], next);
+            if (n == 0)
+                return 0;
+        }
+        p->rx_ts_next.store(ts[0] + n, std::memory_order_relaxed);
+        trx_lms7002m_record(p, 0, bufs, 0, ts[0], n);
+        trx_lms7002m_hw_clock_update(p, end);
+        *ptimestamp = ts[0];
+    }
+    return n;
+}
+
+/*
+ * RX pump
+ *
+ * With rx_pump set, a thread per port keeps LMS_RecvStream busy and
+ * stores what it receives in the port ring, so USB draining no longer
+ * depends on when the eNB calls trx_read. The read functions then only
+ * copy and convert out of the ring. rx_ts_next and the board clock
+ * estimate are updated by the pump, as soon as samples arrive.
+ */
+static inline uint8_t *trx_lms_ring_slot(const TRXLmsRing *r, int slot, int ch)
+{
+    return r->mem + ((size_t)slot * r->nch + ch) * r->stride;
+}
+
+static void trx_lms_ring_delete(TRXLmsRing *r)
+{
+    if (r->event >= 0)
+        close(r->event);
+    if (r->space_event >= 0)
+        close(r->space_event);
+    free(r->mem);
+    delete[] r->ts;
+    delete[] r->len;
+    delete[] r->flags;
+    r->~TRXLmsRing();
+    free(r);
+}
+
+/* A ring of at least 'samples' samples in slots of 'block', plus the
+ * scratch slot */
+static TRXLmsRing *trx_lms_ring_new(int nch, int ssize, int block, int64_t samples)
+{
+    void *m;
+    if (posix_memalign(&m, 64, sizeof(TRXLmsRing)) != 0)
+        return NULL;
+    TRXLmsRing *r = new (m) TRXLmsRing();
+
+    r->nch = nch;
+    r->ssize = ssize;
+    r->block = block;
+    r->slots = 4;
+    while ((int64_t)r->slots * r->block < samples)
+        r->slots *= 2;
+    r->stride = ((size_t)r->block * r->ssize + 63) & ~(size_t)63;
+    r->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->space_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    size_t size = (size_t)(r->slots + 1) * r->nch * r->stride;
+    if (r->event < 0 || r->space_event < 0 || posix_memalign((void**)&r->mem, 64, size) != 0) {
+        r->mem = NULL;
+        trx_lms_ring_delete(r);
+        return NULL;
+    }
+    if (mlock(r->mem, size) != 0)
+        fprintf(stderr, "Cannot lock sample ring in memory\n");
+    memset(r->mem, 0, size);
+    r->ts = new trx_timestamp_t[r->slots]();
+    r->len = new int[r->slots]();
+    r->flags = new bool[r->slots]();
+    return r;
+}
+
+/* Producer: make slot 'head' visible, wake the consumer if it waits */
+static inline void trx_lms_ring_publish(TRXLmsRing *r, uint64_t head)
+{
+    r->head.store(head + 1, std::memory_order_seq_cst);
+    if (r->waiting.load(std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        if (write(r->event, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            r->error.store(-1, std::memory_order_relaxed);
+    }
+}
+
+/* Consumer: wait until a slot is ready, up to 'deadline' (us).
+ * Return false on timeout or producer error. */
+static bool trx_lms_ring_wait(TRXLmsRing *r, int64_t deadline)
+{
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+
+    while (r->head.load(std::memory_order_acquire) == tail) {
+        if (r->error.load(std::memory_order_relaxed))
+            return false;
+        int64_t left = deadline - get_time_us();
+        if (left <= 0)
+            return false;
+        r->waiting.store(true, std::memory_order_seq_cst);
+        if (r->head.load(std::memory_order_seq_cst) == tail) {
+            struct pollfd pfd = { r->event, POLLIN, 0 };
+            uint64_t n;
+            if (poll(&pfd, 1, (int)((left + 999) / 1000)) > 0 &&
+                read(r->event, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                r->error.store(-1, std::memory_order_relaxed);
+        }
+        r->waiting.store(false, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+/* Consumer: free slot 'tail', wake the producer if it waits for one */
+static inline void trx_lms_ring_release(TRXLmsRing *r, uint64_t tail)
+{
+    r->tail.store(tail + 1, std::memory_order_seq_cst);
+    if (r->space_waiting.load(std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        if (write(r->space_event, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            fprintf(stderr, "Cannot wake ring producer: %s\n", strerror(errno));
+    }
+}
+
+/* Producer: wait until a slot is free, up to 'deadline' (us).
+ * Return false on timeout or error. */
+static bool trx_lms_ring_wait_space(TRXLmsRing *r, int64_t deadline)
+{
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+
+    while (head - r->tail.load(std::memory_order_acquire) >= (uint64_t)r->slots) {
+        int64_t left = deadline - get_time_us();
+        if (left <= 0)
+            return false;
+        bool ok = true;
+        r->space_waiting.store(true, std::memory_order_seq_cst);
+        if (head - r->tail.load(std::memory_order_seq_cst) >= (uint64_t)r->slots) {
+            struct pollfd pfd = { r->space_event, POLLIN, 0 };
+            uint64_t n;
+            if (poll(&pfd, 1, (int)((left + 999) / 1000)) > 0 &&
+                read(r->space_event, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                ok = false;
+        }
+        r->space_waiting.store(false, std::memory_order_relaxed);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+/* Streaming helper threads, optionally pinned to 'cpu' and SCHED_FIFO */
+static int trx_lms_thread_create(pthread_t *thread, int cpu, int prio,
+                                 void *(*fn)(void *), void *arg, const char *name)
+{
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    if (prio > 0) {
+        struct sched_param sp;
+        sp.sched_priority = prio;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &sp);
+    }
+    int err = pthread_create(thread, &attr, fn, arg);
+    if (err == EPERM && prio > 0) {
+        fprintf(stderr, "%s: no permission for SCHED_FIFO, running SCHED_OTHER\n", name);
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        err = pthread_create(thread, &attr, fn, arg);
+    }
+    pthread_attr_destroy(&attr);
+    if (err == 0)
+        pthread_setname_np(*thread, name);
+    return err ? -1 : 0;
+}
+
+static void trx_lms7002m_ring_free(TRXLmsPort *p)
+{
+    if (p->ring)
+        trx_lms_ring_delete(p->ring);
+    p->ring = NULL;
+}
+
+static int trx_lms7002m_ring_alloc(TRXLmsState *s, TRXLmsPort *p)
+{
+    int block = (int64_t)p->sample_rate * RX_PUMP_BLOCK_US / 1000000;
+    if (block < 256)
+        block = 256;
+    p->ring = trx_lms_ring_new(p->rx_count, trx_lms_sample_size(&p->rx_stream[0]), block,
+                               (int64_t)p->sample_rate * s->pump_ring_ms / 1000);
+    if (!p->ring)
+        return -1;
+    printf("Port %d: RX ring %d x %d samples\n", p->index, p->ring->slots, p->ring->block);
+    return 0;
+}
+
+static void *trx_lms7002m_pump_thread(void *arg)
+{
+    TRXLmsPort *p = (TRXLmsPort*)arg;
+    TRXLmsRing *r = p->ring;
+    void *bufs[MAX_NUM_CH];
+    int64_t depth_max = 0;
+
+    while (!p->io_stop->load(std::memory_order_relaxed)) {
+        uint64_t head = r->head.load(std::memory_order_relaxed);
+        uint64_t depth = head - r->tail.load(std::memory_order_acquire);
+        bool full = depth >= (uint64_t)r->slots;
+        int slot = full ? r->slots : (int)(head & (r->slots - 1));
+        trx_timestamp_t ts;
+
+        for (int ch = 0; ch < r->nch; ch++)
+            bufs[ch] = trx_lms_ring_slot(r, slot, ch);
+        int n = trx_lms7002m_recv(p, bufs, r->block, &ts);
+        if (n < 0) {
+            r->error.store(n, std::memory_order_relaxed);
+            break;
+        }
+        if (n == 0)
+            continue;
+        if (full) {
+            trx_lms_count(&p->cnt[CNT_RX_RING_FULL]);
+            continue;
+        }
+        r->ts[slot] = ts;
+        r->len[slot] = n;
+        trx_lms_ring_publish(r, head);
+        if ((int64_t)(depth + 1) > depth_max) {
+            depth_max = depth + 1;
+            r->depth_max.store(depth_max * r->block, std::memory_order_relaxed);
+        }
+    }
+    /* wake a waiting reader for good */
+    uint64_t one = 1;
+    if (write(r->event, &one, sizeof(one)) < 0)
+        r->error.store(-1, std::memory_order_relaxed);
+    return NULL;
+}
+
+static void trx_lms7002m_pump_start(TRXLmsState *s)
+{
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        char name[16];
+
+        if (!p->ring)
+            continue;
+        snprintf(name, sizeof(name), "trx_lms_rx%d", i);
+        if (trx_lms_thread_create(&p->pump_thread, s->pump_cpu[i], s->pump_prio,
+                                  trx_lms7002m_pump_thread, p, name) != 0) {
+            fprintf(stderr, "Port %d: cannot create RX pump thread, reading directly\n", i);
+            trx_lms7002m_ring_free(p);
+            continue;
+        }
+        p->pump_running = true;
+    }
+}
+
+static void trx_lms7002m_pump_end(TRXLmsState *s)
+{
+    s->io_stop = true;
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        if (p->pump_running)
+            pthread_join(p->pump_thread, NULL);
+        p->pump_running = false;
+        trx_lms7002m_ring_free(p);
+    }
+}
+
+/* Wait for the next run of received samples, up to 'deadline' (us).
+ * Return its length and timestamp, 0 on timeout, < 0 on error. */
+static int trx_lms7002m_ring_peek(TRXLmsRing *r, trx_timestamp_t *pts, int64_t deadline)
+{
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+
+    if (!trx_lms_ring_wait(r, deadline))
+        return r->error.load(std::memory_order_relaxed);
+    int slot = (int)(tail & (r->slots - 1));
+    *pts = r->ts[slot] + r->offset;
+    return r->len[slot] - r->offset;
+}
+
+static inline void trx_lms7002m_ring_consume(TRXLmsRing *r, int n)
+{
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+
+    r->offset += n;
+    if (r->offset >= r->len[tail & (r->slots - 1)]) {
+        r->offset = 0;
+        r->tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+/* Read 'count' samples from the ring into psamples (cf32), converted
+ * from int16 with 'scale' or copied from float. Samples before a
+ * timestamp discontinuity are dropped, like trx_lms7002m_recv does. */
+static int trx_lms7002m_ring_read(TRXLmsState *s, TRXLmsPort *p, void **psamples, int count,
+                                  trx_timestamp_t *ptimestamp, float scale, int clip,
+                                  int64_t *pwait)
+{
+    TRXLmsRing *r = p->ring;
+    const int64_t deadline = get_time_us() + STREAM_TIMEOUT_MS * 1000;
+    bool is_float = p->rx_stream[0].dataFmt == lms_stream_t::LMS_FMT_F32;
+    int done = 0, clipped = 0;
+    int64_t wait = 0;
+
+    while (done < count) {
+        trx_timestamp_t ts = 0;
+        int64_t t0 = PROF_NOW();
+        int n = trx_lms7002m_ring_peek(r, &ts, deadline);
+        wait += PROF_NOW() - t0;
+        if (n < 0)
+            return n;
+        if (n == 0)
+            break;
+        if (done && ts != *ptimestamp + done)
+            done = 0;
+        if (!done)
+            *ptimestamp = ts;
+        if (n > count - done)
+            n = count - done;
+        int slot = (int)(r->tail.load(std::memory_order_relaxed) & (r->slots - 1));
+        for (int ch = 0; ch < r->nch; ch++) {
+            const uint8_t *src = trx_lms_ring_slot(r, slot, ch) + (size_t)r->offset * r->ssize;
+            float *dst = (float*)psamples[ch] + done*2;
+            float gain = s->rx_dgain[p->rx_ch0 + ch].load(std::memory_order_relaxed);
+            if (is_float) {
+                memcpy(dst, src, (size_t)n * r->ssize);
+                clipped += trx_lms_f32_rx_gain(dst, n*2, gain);
+            } else {
+                clipped += trx_lms_conv.i16_to_f32(dst, (const int16_t*)src, n*2, scale * gain, clip);
+            }
+        }
+        trx_lms7002m_ring_consume(r, n);
+        done += n;
+    }
+    if (done < count)
+        trx_lms_count(&p->cnt[CNT_RX_SHORT]);
+    if (clipped)
+        trx_lms_count(&p->cnt[CNT_RX_CLIP], clipped);
+    *pwait = wait;
+    return done;
+}
+
+/*
+ * TX coalescing
+ *
+ * LimeSuite sends a partial USB packet whenever a write ends off a packet
+ * boundary with a flush, or the next one is not contiguous. With
+ * tx_coalesce set, only whole packets are sent; the remainder is kept
+ * and completed by the next contiguous write. It is flushed at burst
+ * ends, timestamp gaps, or when its time gets within tx_coalesce_us.
+ */
+static void trx_lms7002m_send_stream(TRXLmsPort *p, void **bufs, size_t off, trx_timestamp_t ts,
+                                     int n, bool flush)
+{
+    lms_stream_meta_t meta;
+    const size_t ssize = trx_lms_sample_size(&p->tx_stream[0]);
+
+    trx_lms7002m_record(p, 1, bufs, off, ts, n);
+    meta.waitForTimestamp = true;
+    meta.flushPartialPacket = flush;
+    for (int ch = 0; ch < p->tx_count; ch++) {
+        meta.timestamp = ts + p->dev_ts_offset[p->tx_dev[ch]].load(std::memory_order_relaxed);
+        LMS_SendStream(&p->tx_stream[ch], (uint8_t*)bufs[ch] + off * ssize, n, &meta, STREAM_TIMEOUT_MS);
+    }
+}
+
+static void trx_lms7002m_tx_flush(TRXLmsPort *p)
+{
+    if (p->tx_pend_len == 0)
+        return;
+    trx_lms7002m_send_stream(p, (void**)p->tx_pend, 0, p->tx_pend_ts, p->tx_pend_len, true);
+    trx_lms_count(&p->cnt[CNT_TX_PARTIAL]);
+    p->tx_pend_len = 0;
+}
+
+/* Microseconds until the pending samples must go, 0 if now */
+static int64_t trx_lms7002m_tx_pend_due(const TRXLmsPort *p)
+{
+    trx_timestamp_t cur;
+
+    if (trx_lms7002m_cur_timestamp(p, &cur) != 0)
+        return 0;
+    int64_t left = p->tx_pend_ts - p->tx_pend_lead - cur;
+    return left > 0 ? left * 1000000 / p->sample_rate : 0;
+}
+
+static void trx_lms7002m_tx_deadline(TRXLmsPort *p)
+{
+    if (p->tx_pend_len && trx_lms7002m_tx_pend_due(p) == 0)
+        trx_lms7002m_tx_flush(p);
+}
+
+/* Send 'n' samples at 'ts', in whole device packets if coalescing */
+static void trx_lms7002m_tx_push(TRXLmsPort *p, void **bufs, trx_timestamp_t ts, int n, bool flush)
+{
+    const int spp = p->tx_spp;
+    const size_t ssize = trx_lms_sample_size(&p->tx_stream[0]);
+    int done = 0;
+
+    if (!spp) {
+        trx_lms7002m_send_stream(p, bufs, 0, ts, n, flush);
+        return;
+    }
+    if (p->tx_pend_len && ts != p->tx_pend_ts + p->tx_pend_len)
+        trx_lms7002m_tx_flush(p);
+    if (p->tx_pend_len) {
+        /* complete the pending packet first */
+        done = spp - p->tx_pend_len;
+        if (done > n)
+            done = n;
+        for (int ch = 0; ch < p->tx_count; ch++)
+            memcpy(p->tx_pend[ch] + p->tx_pend_len * ssize, bufs[ch], done * ssize);
+        p->tx_pend_len += done;
+        if (p->tx_pend_len < spp) {
+            if (flush)
+                trx_lms7002m_tx_flush(p);
+            return;
+        }
+        trx_lms7002m_send_stream(p, (void**)p->tx_pend, 0, p->tx_pend_ts, spp, false);
+        p->tx_pend_len = 0;
+    }
+    int rest = n - done;
+    int whole = flush ? rest : rest / spp * spp;
+    if (whole > 0) {
+        trx_lms7002m_send_stream(p, bufs, done, ts + done, whole, flush);
+        if (whole % spp)
+            trx_lms_count(&p->cnt[CNT_TX_PARTIAL]);
+    }
+    if (whole < rest) {
+        for (int ch = 0; ch < p->tx_count; ch++)
+            memcpy(p->tx_pend[ch], (uint8_t*)bufs[ch] + (done + whole) * ssize, (rest - whole) * ssize);
+        p->tx_pend_ts = ts + done + whole;
+        p->tx_pend_len = rest - whole;
+    }
+}
+
+static int trx_lms7002m_coalesce_alloc(TRXLmsState *s, TRXLmsPort *p)
+{
+    const size_t ssize = trx_lms_sample_size(&p->tx_stream[0]);
+
+    p->tx_spp = (p->tx_stream[0].dataFmt == lms_stream_t::LMS_FMT_I12 ? 1360 : 1020) / s->tx_dev_ch;
+    p->tx_pend_lead = (int64_t)p->sample_rate * s->tx_coalesce_us / 1000000;
+    p->tx_pend_len = 0;
+    for (int ch = 0; ch < p->tx_count; ch++) {
+        if (posix_memalign((void**)&p->tx_pend[ch], 64, p->tx_spp * ssize) != 0) {
+            p->tx_pend[ch] = NULL;
+            fprintf(stderr, "Cannot allocate TX coalescing buffers\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void trx_lms7002m_coalesce_free(TRXLmsPort *p)
+{
+    for (int ch = 0; ch < MAX_NUM_CH; ch++) {
+        free(p->tx_pend[ch]);
+        p->tx_pend[ch] = NULL;
+    }
+    p->tx_spp = 0;
+}
+
+/*
+ * TX writer
+ *
+ * With tx_writer set, writes are converted into the port TX queue and
+ * return at once; a thread per port sends the queued slots to LimeSuite
+ * in submission order, which is timestamp order since LTEENB writes each
+ * port in sequence. The write thread only waits when the queue is full.
+ * The writer records the TX margin: timestamp of each slot minus the
+ * board time when it is handed to LimeSuite.
+ */
+static int trx_lms7002m_writer_alloc(TRXLmsState *s, TRXLmsPort *p)
+{
+    /* one slot per write of LTEENB, a subframe or slot at most */
+    int block = p->sample_rate / 1000;
+    if (block < 4096)
+        block = 4096;
+    p->txq = trx_lms_ring_new(p->tx_count, trx_lms_sample_size(&p->tx_stream[0]), block,
+                              (int64_t)p->sample_rate * s->writer_queue_ms / 1000);
+    if (!p->txq)
+        return -1;
+    p->tx_margin_min = INT64_MAX;
+    printf("Port %d: TX queue %d x %d samples\n", p->index, p->txq->slots, p->txq->block);
+    return 0;
+}
+
+static void trx_lms7002m_writer_free(TRXLmsPort *p)
+{
+    if (p->txq)
+        trx_lms_ring_delete(p->txq);
+    p->txq = NULL;
+}
+
+static void *trx_lms7002m_writer_thread(void *arg)
+{
+    TRXLmsPort *p = (TRXLmsPort*)arg;
+    TRXLmsRing *q = p->txq;
+    int64_t margin_min = INT64_MAX;
+
+    while (!p->io_stop->load(std::memory_order_relaxed)) {
+        int64_t wait = STREAM_TIMEOUT_MS * 1000;
+        if (p->tx_pend_len && trx_lms7002m_tx_pend_due(p) < wait)
+            wait = trx_lms7002m_tx_pend_due(p);
+        bool ready = trx_lms_ring_wait(q, get_time_us() + wait);
+        if (!ready) {
+            trx_lms7002m_tx_deadline(p);
+            continue;
+        }
+        /* everything queued so far in one go */
+        uint64_t tail = q->tail.load(std::memory_order_relaxed);
+        uint64_t head = q->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            int slot = (int)(tail & (q->slots - 1));
+            trx_timestamp_t cur;
+            if (trx_lms7002m_cur_timestamp(p, &cur) == 0) {
+                int64_t margin = q->ts[slot] - cur;
+                p->tx_margin.store(margin, std::memory_order_relaxed);
+                if (margin < margin_min) {
+                    margin_min = margin;
+                    p->tx_margin_min.store(margin, std::memory_order_relaxed);
+                }
+            }
+            void *bufs[MAX_NUM_CH];
+            for (int ch = 0; ch < q->nch; ch++)
+                bufs[ch] = trx_lms_ring_slot(q, slot, ch);
+            trx_lms7002m_tx_push(p, bufs, q->ts[slot], q->len[slot], q->flags[slot]);
+            trx_lms_ring_release(q, tail);
+        }
+        trx_lms7002m_tx_deadline(p);
+    }
+    return NULL;
+}
+
+static void trx_lms7002m_writer_start(TRXLmsState *s)
+{
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        char name[16];
+
+        if (!p->txq)
+            continue;
+        snprintf(name, sizeof(name), "trx_lms_tx%d", i);
+        if (trx_lms_thread_create(&p->writer_thread, s->writer_cpu[i], s->writer_prio,
+                                  trx_lms7002m_writer_thread, p, name) != 0) {
+            fprintf(stderr, "Port %d: cannot create TX writer thread, writing directly\n", i);
+            trx_lms7002m_writer_free(p);
+            continue;
+        }
+        p->writer_running = true;
+    }
+}
+
+static void trx_lms7002m_writer_end(TRXLmsState *s)
+{
+    s->io_stop = true;
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        if (p->writer_running) {
+            uint64_t one = 1;
+            if (write(p->txq->event, &one, sizeof(one)) < 0)
+                perror("TX writer");
+            pthread_join(p->writer_thread, NULL);
+        }
+        p->writer_running = false;
+        trx_lms7002m_writer_free(p);
+    }
+}
+
+/* Buffers for the next (at most) 'n' samples to send: a queue slot with
+ * the TX writer, else the staging buffers. Return 0 if the queue stayed
+ * full, the write is then dropped like LMS_SendStream would time out. */
+static int trx_lms7002m_tx_stage(TRXLmsState *s, TRXLmsPort *p, int n, void **dst)
+{
+    TRXLmsRing *q = p->txq;
+
+    if (!q) {
+        if (n > s->buf_samples)
+            n = s->buf_samples;
+        for (int ch = 0; ch < p->tx_count; ch++)
+            dst[ch] = p->tx_buf[ch];
+        return n;
+    }
+    uint64_t head = q->head.load(std::memory_order_relaxed);
+    if (head - q->tail.load(std::memory_order_acquire) >= (uint64_t)q->slots &&
+        !trx_lms_ring_wait_space(q, get_time_us() + STREAM_TIMEOUT_MS * 1000))
+        return 0;
+    if (n > q->block)
+        n = q->block;
+    for (int ch = 0; ch < q->nch; ch++)
+        dst[ch] = trx_lms_ring_slot(q, (int)(head & (q->slots - 1)), ch);
+    return n;
+}
+
+/* Send what trx_lms7002m_tx_stage returned, or queue it for the writer */
+static void trx_lms7002m_tx_send(TRXLmsPort *p, void **bufs, trx_timestamp_t ts, int n, bool flush)
+{
+    TRXLmsRing *q = p->txq;
+
+    if (q) {
+        uint64_t head = q->head.load(std::memory_order_relaxed);
+        int slot = (int)(head & (q->slots - 1));
+        q->ts[slot] = ts;
+        q->len[slot] = n;
+        q->flags[slot] = flush;
+        trx_lms_ring_publish(q, head);
+        return;
+    }
+    trx_lms7002m_tx_push(p, bufs, ts, n, flush);
+}
+
+/* Start of a write on the write thread: nothing to send, or a gap
+ * before 'ts', ends the pending packet. The TX writer checks its own
+ * deadlines. */
+static void trx_lms7002m_tx_begin(TRXLmsPort *p, trx_timestamp_t ts, bool samples)
+{
+    if (!p->txq && p->tx_pend_len && (!samples || ts != p->tx_pend_ts + p->tx_pend_len))
+        trx_lms7002m_tx_flush(p);
+}
+
+/*
+ * IQ recorder
+ *
+ * With record_ring_ms set, each port has an RX and a TX ring of that
+ * length. While a recording of the port is on (message API "record"),
+ * the threads calling LMS_RecvStream/LMS_SendStream copy the samples in
+ * the stream format into the rings and never wait: a block finding the
+ * ring full is dropped and counted. The recorder thread moves the blocks
+ * to memory mapped SigMF data files, at their timestamp offset, so that
+ * dropped blocks and TX gaps read back as zeros.
+ */
+static void trx_lms7002m_rec_put(TRXLmsPort *p, int dir, void **bufs, size_t off, trx_timestamp_t ts, int n)
+{
+    TRXLmsRing *r = p->rec[dir];
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+
+    for (int done = 0; done < n; ) {
+        int k = n - done < r->block ? n - done : r->block;
+        if (head - r->tail.load(std::memory_order_acquire) >= (uint64_t)r->slots) {
+            trx_lms_count(&p->cnt[dir ? CNT_TX_REC_DROPPED : CNT_RX_REC_DROPPED]);
+            return;
+        }
+        int slot = (int)(head & (r->slots - 1));
+        for (int ch = 0; ch < r->nch; ch++)
+            memcpy(trx_lms_ring_slot(r, slot, ch), (uint8_t*)bufs[ch] + (off + done) * r->ssize, k * r->ssize);
+        r->ts[slot] = ts + done;
+        r->len[slot] = k;
+        trx_lms_ring_publish(r, head++);
+        done += k;
+    }
+}
+
+/* Move the ring blocks to the recording, or drop them if 'rec' is NULL */
+static void trx_lms7002m_rec_drain(TRXLmsRecord *rec, TRXLmsRing *r, int dir)
+{
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    uint64_t head = r->head.load(std::memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        int slot = (int)(tail & (r->slots - 1));
+        if (rec && rec->nch[dir]) {
+            if (rec->start[dir] < 0)
+                rec->start[dir] = r->ts[slot];
+            int64_t pos = r->ts[slot] - rec->start[dir];
+            int64_t a = pos > 0 ? pos : 0;
+            int64_t b = pos + r->len[slot] < rec->samples ? pos + r->len[slot] : rec->samples;
+            for (int ch = 0; a < b && ch < rec->nch[dir]; ch++)
+                memcpy(rec->map[dir][ch] + a * r->ssize, trx_lms_ring_slot(r, slot, ch) + (a - pos) * r->ssize,
+                       (b - a) * r->ssize);
+            if (b > rec->written[dir])
+                rec->written[dir] = b;
+        }
+        r->tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+static void trx_lms7002m_rec_meta(TRXLmsState *s, TRXLmsRecord *rec, int dir, int ch, const char *path)
+{
+    TRXLmsPort *p = &s->port[rec->port];
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        return;
+    }
+    bool f32 = (dir ? p->tx_stream : p->rx_stream)->dataFmt == lms_stream_t::LMS_FMT_F32;
+    bool i12 = (dir ? p->tx_stream : p->rx_stream)->dataFmt == lms_stream_t::LMS_FMT_I12;
+    fprintf(f, "{\n"
+            "    \"global\": {\n"
+            "        \"core:datatype\": \"%s\",\n"
+            "        \"core:sample_rate\": %d,\n"
+            "        \"core:version\": \"1.0.0\",\n"
+            "        \"core:hw\": \"LMS7002M (%s)\",\n"
+            "        \"core:recorder\": \"trx_lms7002m\",\n"
+            "        \"core:description\": \"%s channel %d%s\"\n"
+            "    },\n"
+            "    \"captures\": [\n"
+            "        {\n"
+            "            \"core:sample_start\": 0,\n"
+            "            \"core:global_index\": %" PRId64 ",\n"
+            "            \"core:frequency\": %.0f,\n"
+            "            \"core:datetime\": \"%s\"\n"
+            "        }\n"
+            "    ],\n"
+            "    \"annotations\": []\n"
+            "}\n",
+            f32 ? "cf32_le" : "ci16_le", p->sample_rate, s->link, dir ? "TX" : "RX",
+            (dir ? p->tx_ch0 : p->rx_ch0) + ch, i12 ? ", 12 bit samples" : "",
+            rec->start[dir] > 0 ? (int64_t)rec->start[dir] : 0,
+            rec->freq[dir], rec->datetime);
+    fclose(f);
+}
+
+/* Unmap and close the data files, cut to what was covered, and write
+ * the metadata. 'ok' is false when the recording could not start. */
+static void trx_lms7002m_rec_close(TRXLmsState *s, TRXLmsRecord *rec, bool ok)
+{
+    TRXLmsPort *p = &s->port[rec->port];
+
+    for (int dir = 0; dir < 2; dir++) {
+        size_t ssize = trx_lms_sample_size(dir ? &p->tx_stream[0] : &p->rx_stream[0]);
+        for (int ch = 0; ch < rec->nch[dir]; ch++) {
+            char path[300];
+            if (rec->map[dir][ch])
+                munmap(rec->map[dir][ch], rec->samples * ssize);
+            rec->map[dir][ch] = NULL;
+            if (rec->fd[dir][ch] < 0)
+                continue;
+            if (ok && ftruncate(rec->fd[dir][ch], rec->written[dir] * ssize) != 0)
+                perror("recorder");
+            close(rec->fd[dir][ch]);
+            rec->fd[dir][ch] = -1;
+            snprintf(path, sizeof(path), "%s_%s%d.sigmf-%s", rec->file, dir ? "tx" : "rx",
+                     (dir ? p->tx_ch0 : p->rx_ch0) + ch, ok ? "meta" : "data");
+            if (ok)
+                trx_lms7002m_rec_meta(s, rec, dir, ch, path);
+            else
+                unlink(path);
+        }
+    }
+    if (ok)
+        printf("Recorded %s: %" PRId64 " RX, %" PRId64 " TX samples\n", rec->file,
+               rec->written[0], rec->written[1]);
+}
+
+/* Control thread: create the files and start recording 'samples' of
+ * 'port'. Return an error message or NULL. */
+static const char *trx_lms7002m_rec_open(TRXLmsState *s, int port, int64_t samples, const char *file)
+{
+    TRXLmsRecord *rec = &s->rec;
+    TRXLmsPort *p = &s->port[port];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (!s->rec_running)
+        return "recorder disabled, see record_ring_ms";
+    if (s->rec_active.load(std::memory_order_acquire))
+        return "recording in progress";
+
+    memset(rec, 0, sizeof(*rec));
+    rec->port = port;
+    rec->samples = samples;
+    snprintf(rec->file, sizeof(rec->file), "%s", file);
+    gmtime_r(&now, &tm);
+    strftime(rec->datetime, sizeof(rec->datetime), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    rec->freq[0] = s->rx_freq;
+    rec->freq[1] = s->tx_freq;
+    rec->nch[0] = p->rec[0] ? p->rx_count : 0;
+    rec->nch[1] = p->rec[1] ? p->tx_count : 0;
+    for (int dir = 0; dir < 2; dir++) {
+        rec->start[dir] = -1;
+        for (int ch = 0; ch < MAX_NUM_CH; ch++)
+            rec->fd[dir][ch] = -1;
+    }
+    for (int dir = 0; dir < 2; dir++) {
+        size_t size = rec->samples * trx_lms_sample_size(dir ? &p->tx_stream[0] : &p->rx_stream[0]);
+        for (int ch = 0; ch < rec->nch[dir]; ch++) {
+            char path[300];
+            snprintf(path, sizeof(path), "%s_%s%d.sigmf-data", rec->file, dir ? "tx" : "rx",
+                     (dir ? p->tx_ch0 : p->rx_ch0) + ch);
+            rec->fd[dir][ch] = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (rec->fd[dir][ch] < 0 || ftruncate(rec->fd[dir][ch], size) != 0) {
+                trx_lms7002m_rec_close(s, rec, false);
+                return "cannot create the data files";
+            }
+            void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fd[dir][ch], 0);
+            if (m == MAP_FAILED) {
+                trx_lms7002m_rec_close(s, rec, false);
+                return "cannot map the data files";
+            }
+            rec->map[dir][ch] = (uint8_t*)m;
+        }
+    }
+    /* TX may not be streaming: give up one second after the end */
+    rec->deadline = get_time_us() + rec->samples * 1000000 / p->sample_rate + 1000000;
+    s->rec_active.store(true, std::memory_order_release);
+    p->rec_on.store(true, std::memory_order_release);
+    return NULL;
+}
+
+static void *trx_lms7002m_rec_thread(void *arg)
+{
+    TRXLmsState *s = (TRXLmsState*)arg;
+    TRXLmsRecord *rec = &s->rec;
+
+    while (!s->io_stop.load(std::memory_order_relaxed)) {
+        usleep(REC_POLL_MS * 1000);
+        bool active = s->rec_active.load(std::memory_order_acquire);
+        for (int i = 0; i < s->port_count; i++)
+            for (int dir = 0; dir < 2; dir++)
+                if (s->port[i].rec[dir])
+                    trx_lms7002m_rec_drain(active && rec->port == i ? rec : NULL, s->port[i].rec[dir], dir);
+        if (!active)
+            continue;
+        bool done = true;
+        for (int dir = 0; dir < 2; dir++)
+            if (rec->nch[dir] && rec->written[dir] < rec->samples)
+                done = false;
+        if (done || get_time_us() >= rec->deadline) {
+            TRXLmsPort *p = &s->port[rec->port];
+            p->rec_on.store(false, std::memory_order_relaxed);
+            /* blocks being copied as the recording stops */
+            usleep(REC_POLL_MS * 1000);
+            for (int dir = 0; dir < 2; dir++)
+                if (p->rec[dir])
+                    trx_lms7002m_rec_drain(rec, p->rec[dir], dir);
+            trx_lms7002m_rec_close(s, rec, true);
+            s->rec_active.store(false, std::memory_order_release);
+        }
+    }
+    if (s->rec_active.load(std::memory_order_acquire)) {
+        trx_lms7002m_rec_close(s, rec, true);
+        s->rec_active.store(false);
+    }
+    return NULL;
+}
+
+static int trx_lms7002m_rec_start(TRXLmsState *s)
+{
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        int block = (int64_t)p->sample_rate * REC_BLOCK_US / 1000000;
+        int64_t samples = (int64_t)p->sample_rate * s->rec_ring_ms / 1000;
+        if (block < 256)
+            block = 256;
+        for (int dir = 0; dir < 2; dir++) {
+            int nch = dir ? p->tx_count : p->rx_count;
+            if (!nch)
+                continue;
+            p->rec[dir] = trx_lms_ring_new(nch, trx_lms_sample_size(dir ? &p->tx_stream[0] : &p->rx_stream[0]),
+                                           block, samples);
+            if (!p->rec[dir]) {
+                fprintf(stderr, "Cannot allocate the recorder rings\n");
+                return -1;
+            }
+        }
+    }
+    if (trx_lms_thread_create(&s->rec_thread, -1, 0, trx_lms7002m_rec_thread, s, "trx_lms_rec") != 0) {
+        fprintf(stderr, "Cannot create the recorder thread\n");
+        return -1;
+    }
+    s->rec_running = true;
+    printf("Recorder: %d ms rings\n", s->rec_ring_ms);
+    return 0;
+}
+
+static void trx_lms7002m_rec_end(TRXLmsState *s)
+{
+    s->io_stop = true;
+    if (s->rec_running)
+        pthread_join(s->rec_thread, NULL);
+    s->rec_running = false;
+    for (int i = 0; i < s->port_count; i++) {
+        for (int dir = 0; dir < 2; dir++) {
+            if (s->port[i].rec[dir])
+                trx_lms_ring_delete(s->port[i].rec[dir]);
+            s->port[i].rec[dir] = NULL;
+        }
+    }
+}
+
+/* A write for samples older than what RX already delivered is too late */
+static inline void trx_lms7002m_check_late(TRXLmsPort *p, trx_timestamp_t timestamp)
+{
+    if (timestamp < p->rx_ts_next.load(std::memory_order_relaxed))
+        trx_lms_count(&p->cnt[CNT_TX_LATE]);
+}
+
+static inline int64_t trx_lms_mod(int64_t a, int64_t m)
+{
+    a %= m;
+    return a < 0 ? a + m : a;
+}
+
+/* LTE TDD, 36.211 tables 4.2-1 and 4.2-2 */
+static const char tdd_lte_uldl[7][11] = {
+    "DSUUUDSUUU", "DSUUDDSUUD", "DSUDDDSUDD", "DSUUUDDDDD",
+    "DSUUDDDDDD", "DSUDDDDDDD", "DSUUUDSUUD",
+};
+/* DwPTS in Ts (1/30.72 MHz) for each special subframe configuration */
+static const int tdd_lte_dwpts[2][10] = {
+    { 6592, 19760, 21952, 24144, 26336, 6592, 19760, 21952, 24144, 13168 },
+    { 7680, 20480, 23040, 25600, 7680, 20480, 23040, 12800, 12800, 12800 },
+};
+/* NR dl-UL-TransmissionPeriodicity, in us */
+static const int tdd_nr_period_us[10] = {
+    500, 625, 1000, 1250, 2000, 2500, 5000, 10000, 3000, 4000,
+};
+
+static inline int64_t tdd_samples(int64_t ts_units, double rate)
+{
+    return (int64_t)(ts_units * rate / 30.72e6);
+}
+
+/* Downlink bursts of a LTE frame, each starting after an uplink subframe */
+static int trx_lms_tdd_lte(TRXLmsTdd *t, const TRXCellInfo *c, double rate)
+{
+    int cfg = c->u.tdd.uldl_config, ss = c->u.tdd.special_subframe_config;
+    int ecp = c->dl_cyclic_prefix == TRXCellInfo::TRX_CYCLIC_PREFIX_EXTENDED;
+
+    if (cfg > 6 || ss > 9)
+        return -1;
+    const char *sf = tdd_lte_uldl[cfg];
+    int len = 10;
+    /* 5 ms switch point periodicity */
+    if (!memcmp(sf, sf + 5, 5))
+        len = 5;
+    t->period = tdd_samples(len * 30720, rate);
+    t->burst_count = 0;
+    for (int i = 0; i < len; i++) {
+        if (sf[i] == 'U' || sf[(i + len - 1) % len] != 'U')
+            continue;
+        int j = i;
+        while (sf[j % len] == 'D')
+            j++;
+        /* j: special subframe ending the burst */
+        t->dl_start[t->burst_count] = tdd_samples(i * 30720, rate);
+        t->dl_end[t->burst_count] = tdd_samples(j * 30720 + tdd_lte_dwpts[ecp][ss], rate);
+        t->burst_count++;
+    }
+    return 0;
+}
+
+/* Single downlink burst at the start of a NR pattern. Symbols are
+ * 2192 Ts >> mu, the first symbol of each 0.5 ms is 16 Ts longer. */
+static int trx_lms_tdd_nr(TRXLmsTdd *t, const TRXCellInfo *c, double rate)
+{
+    int mu = c->u.nr_tdd.dl_subcarrier_spacing;
+
+    if (c->u.nr_tdd.period_asn1 >= 10 || mu < 0 || mu > 3)
+        return -1;
+    int64_t end = 0;
+    int symbs = c->u.nr_tdd.dl_slots * 14 + c->u.nr_tdd.dl_symbs;
+    for (int j = 0; j < symbs; j++)
+        end += (2192 >> mu) + (j % (7 << mu) ? 0 : 16);
+    t->period = tdd_samples(tdd_nr_period_us[c->u.nr_tdd.period_asn1] * 30720LL / 1000, rate);
+    t->burst_count = 1;
+    t->dl_start[0] = 0;
+    t->dl_end[0] = tdd_samples(end, rate);
+    return 0;
+}
+
+/* Set up TDD gating of a port from the first TDD cell using it */
+static void trx_lms7002m_tdd_init(TRXLmsPort *p, const TRXDriverParams *tp, double rate, bool gate)
+{
+    TRXLmsTdd *t = &p->tdd;
+
+    memset(t, 0, sizeof(*t));
+    t->phase = -1;
+    t->tx_end = TDD_NO_WRITE;
+    for (int i = 0; i < tp->cell_count; i++) {
+        const TRXCellInfo *c = &tp->cell_info[i];
+        int ret;
+        if (c->rf_port_index != p->index)
+            continue;
+        if (c->type == TRXCellInfo::TRX_CELL_TYPE_TDD)
+            ret = trx_lms_tdd_lte(t, c, rate);
+        else if (c->type == TRXCellInfo::TRX_NRCELL_TYPE_TDD)
+            ret = trx_lms_tdd_nr(t, c, rate);
+        else
+            continue;
+        if (ret < 0 || t->period <= 0 || !t->burst_count) {
+            fprintf(stderr, "Port %d: unsupported TDD configuration, no TX gating\n", p->index);
+            t->period = 0;
+            return;
+        }
+        t->gate = gate;
+        printf("Port %d: TDD period %" PRId64 " samples, %d downlink burst(s), first %" PRId64 "..%" PRId64 "\n",
+               p->index, t->period, t->burst_count, t->dl_start[0], t->dl_end[0]);
+        return;
+    }
+}
+
+static bool trx_lms_tdd_is_start(const TRXLmsTdd *t, int64_t pos)
+{
+    for (int i = 0; i < t->burst_count; i++)
+        if (pos == t->dl_start[i])
+            return true;
+    return false;
+}
+
+/* A TX burst starts at 'ts': keep the frame phases it agrees with. A
+ * burst matching none of them restarts the locking. */
+static void trx_lms7002m_tdd_burst(TRXLmsPort *p, trx_timestamp_t ts)
+{
+    TRXLmsTdd *t = &p->tdd;
+    int n = 0;
+
+    for (int i = 0; i < t->cand_count; i++)
+        if (trx_lms_tdd_is_start(t, trx_lms_mod(ts - t->cand[i], t->period)))
+            t->cand[n++] = t->cand[i];
+    if (n == 0) {
+        if (t->phase >= 0)
+            trx_lms_count(&p->cnt[CNT_TX_MISALIGNED]);
+        for (int i = 0; i < t->burst_count; i++)
+            t->cand[i] = trx_lms_mod(ts - t->dl_start[i], t->period);
+        n = t->burst_count;
+        t->phase = -1;
+    }
+    t->cand_count = n;
+    if (n == 1)
+        t->phase = t->cand[0];
+}
+
+/* Part of a write [ts, ts + count) inside a downlink burst: returns the
+ * number of samples to send after skipping *pskip, and whether the burst
+ * ends with them. The tail of a special subframe after DwPTS is cut
+ * silently. Everything is sent until the phase is locked. */
+static int trx_lms7002m_tdd_gate(TRXLmsPort *p, trx_timestamp_t ts, int count, int *pskip, bool *pend)
+{
+    TRXLmsTdd *t = &p->tdd;
+
+    *pskip = 0;
+    *pend = false;
+    if (!t->gate || t->phase < 0)
+        return count;
+
+    int64_t pos = trx_lms_mod(ts - t->phase, t->period);
+    for (int k = -1; k <= 1; k++) {
+        for (int i = 0; i < t->burst_count; i++) {
+            int64_t start = t->dl_start[i] + k * t->period;
+            int64_t end = t->dl_end[i] + k * t->period;
+            int64_t a = pos > start ? pos : start;
+            int64_t b = pos + count < end ? pos + count : end;
+            if (a >= b)
+                continue;
+            *pskip = a - pos;
+            *pend = b == end;
+            return b - a;
+        }
+    }
+    trx_lms_count(&p->cnt[CNT_TX_UPLINK]);
+    return 0;
+}
+
+/* Burst tracking of a write, 'samples' NULL for padding */
+static inline void trx_lms7002m_tdd_write(TRXLmsPort *p, trx_timestamp_t ts, const void **samples, int count, int flags)
+{
+    TRXLmsTdd *t = &p->tdd;
+
+    if (!t->period)
+        return;
+    if (!samples) {
+        t->tx_end = -1;
+        return;
+    }
+    /* TX may start in the middle of a burst: the first write locks nothing */
+    if (ts != t->tx_end && t->tx_end != TDD_NO_WRITE)
+        trx_lms7002m_tdd_burst(p, ts);
+    t->tx_end = (flags & TRX_WRITE_FLAG_END_OF_BURST) ? -1 : ts + count;
+}
+
+static void trx_lms7002m_snapshot_fill(TRXLmsState *s, TRXLmsPort *p, void **psamples, int count, trx_timestamp_t timestamp)
+{
+    TRXLmsSnapshot *snap = &s->snapshot;
+
+    if (snap->port.load(std::memory_order_relaxed) != p->index)
+        return;
+    snap->busy.fetch_add(1);
+    if (snap->armed.load() && snap->port.load() == p->index) {
+        int n = snap->count - snap->filled;
+        if (n > count)
+            n = count;
+        if (snap->filled == 0)
+            snap->timestamp = timestamp;
+        for (int ch = 0; ch < p->rx_count; ch++)
+            memcpy(snap->buf[ch] + snap->filled*2, psamples[ch], n*2*sizeof(float));
+        snap->filled += n;
+        if (snap->filled == snap->count)
+            snap->armed.store(0);
+    }
+    snap->busy.fetch_sub(1, std::memory_order_release);
+}
+
+/* Copy received samples to a pending snapshot, if any */
+static inline void trx_lms7002m_snapshot(TRXLmsState *s, TRXLmsPort *p, void **psamples, int count, trx_timestamp_t timestamp)
+{
+    if (count > 0 && s->snapshot.armed.load(std::memory_order_relaxed))
+        trx_lms7002m_snapshot_fill(s, p, psamples, count, timestamp);
+}
+
+static void trx_lms7002m_write(TRXState *s1, trx_timestamp_t timestamp,
+                               const void **samples, int count, int flags,
+                               int rf_port_index)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    TRXLmsPort *p = &s->port[rf_port_index];
+    int skip;
+    bool end;
+
+    trx_lms7002m_tdd_write(p, timestamp, samples, count, flags);
+    trx_lms7002m_tx_begin(p, timestamp, samples != NULL);
+    // Nothing to transmit
+    if (!samples)
+        return;
+    trx_lms7002m_check_late(p, timestamp);
+    int n_send = trx_lms7002m_tdd_gate(p, timestamp, count, &skip, &end);
+    if (n_send <= 0)
+        return;
+    count = skip + n_send;
+
+    /* staged for the digital gain and saturation */
+    int64_t t0 = PROF_NOW(), io = 0, conv = 0;
+    int clipped = 0;
+    for (int done = skip; done < count; ) {
+        void *buf[MAX_NUM_CH];
+        int64_t ta = PROF_NOW();
+        int n = trx_lms7002m_tx_stage(s, p, count - done, buf);
+        if (n == 0) {
+            trx_lms_count(&p->cnt[CNT_TX_QUEUE_FULL]);
+            break;
+        }
+        int64_t tb = PROF_NOW();
+        for (int ch = 0; ch < p->tx_count; ch++)
+            clipped += trx_lms_f32_tx_gain((float*)buf[ch], (const float*)samples[ch] + done*2, n*2,
+                                           s->tx_dgain[p->tx_ch0 + ch].load(std::memory_order_relaxed));
+        int64_t tc = PROF_NOW();
+        trx_lms7002m_tx_send(p, buf, timestamp + done, n,
+                             done + n == count && (end || (flags&TRX_WRITE_FLAG_END_OF_BURST)));
+        int64_t td = PROF_NOW();
+        conv += tc - tb;
+        io += (tb - ta) + (td - tc);
+        done += n;
+    }
+    if (clipped)
+        trx_lms_count(&p->cnt[CNT_TX_CLIP], clipped);
+    PROF_CALL(&p->tx_prof, t0, io, conv, PROF_NOW());
+}
+
+static int trx_lms7002m_read(TRXState *s1, trx_timestamp_t *ptimestamp, void **psamples, int count, int port)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    TRXLmsPort *p = &s->port[port];
+
+    // First shot ?
+    if (!s->started.load(std::memory_order_acquire))
+        trx_lms7002m_start_streams(s);
+
+    if (p->ring) {
+        int64_t t0 = PROF_NOW(), wait = 0;
+        int ret = trx_lms7002m_ring_read(s, p, psamples, count, ptimestamp, 1.0f, 0, &wait);
+        int64_t t1 = PROF_NOW();
+        PROF_CALL(&p->rx_prof, t0, wait, t1 - t0 - wait, t1);
+        trx_lms7002m_snapshot(s, p, psamples, ret, *ptimestamp);
+        return ret;
+    }
+
+    int64_t t0 = PROF_NOW();
+    int ret = trx_lms7002m_recv(p, psamples, count, ptimestamp);
+    int64_t t1 = PROF_NOW();
+    if (ret > 0) {
+        int clipped = 0;
+        for (int ch = 0; ch < p->rx_count; ch++)
+            clipped += trx_lms_f32_rx_gain((float*)psamples[ch], ret*2,
+                                           s->rx_dgain[p->rx_ch0 + ch].load(std::memory_order_relaxed));
+        if (clipped)
+            trx_lms_count(&p->cnt[CNT_RX_CLIP], clipped);
+    }
+    int64_t t2 = PROF_NOW();
+    PROF_CALL(&p->rx_prof, t0, t1 - t0, t2 - t1, t2);
+    trx_lms7002m_snapshot(s, p, psamples, ret, *ptimestamp);
+    return ret;
+}
+
+/* Fill cur_timestamp when asked for, so LTEENB can track its TX margin */
+static inline void trx_lms7002m_write_md(TRXState *s1, int port, TRXWriteMetadata *md)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+
+    if ((md->flags & TRX_WRITE_MD_FLAG_CUR_TIMESTAMP_REQ) &&
+        trx_lms7002m_cur_timestamp(&s->port[port], &md->cur_timestamp) == 0)
+        md->cur_timestamp_set = 1;
+}
+
+void trx_lms7002m_write2(TRXState *s, trx_timestamp_t timestamp, const void **samples, int count, int port, TRXWriteMetadata *md)
+{
+    trx_lms7002m_write_md(s, port, md);
+    trx_lms7002m_write(s, timestamp, samples, count, md->flags, port);
+}
+int trx_lms7002m_read2(TRXState *s, trx_timestamp_t *ptimestamp, void **samples, int count, int port, TRXReadMetadata *md)
+{
+    return trx_lms7002m_read(s, ptimestamp, samples, count, port);
+}
+
+
+static void trx_lms7002m_write_int(TRXState *s1, trx_timestamp_t timestamp,
+                               const void **samples, int count, int flags,
+                               int rf_port_index)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    TRXLmsPort *p = &s->port[rf_port_index];
+    const float maxValue = s->tx_stream->dataFmt == lms_stream_t::LMS_FMT_I12 ? 2047.0f : 32767.0f;
+    int skip;
+    bool end;
+
+    trx_lms7002m_tdd_write(p, timestamp, samples, count, flags);
+    trx_lms7002m_tx_begin(p, timestamp, samples != NULL);
+    // Nothing to transmit
+    if (!samples)
+        return;
+    trx_lms7002m_check_late(p, timestamp);
+    int n_send = trx_lms7002m_tdd_gate(p, timestamp, count, &skip, &end);
+    if (n_send <= 0)
+        return;
+    count = skip + n_send;
+
+    int64_t t0 = PROF_NOW(), io = 0, conv = 0;
+    int clipped = 0;
+    for (int done = skip; done < count; ) {
+        void *buf[MAX_NUM_CH];
+        int64_t ta = PROF_NOW();
+        int n = trx_lms7002m_tx_stage(s, p, count - done, buf);
+        if (n == 0) {
+            trx_lms_count(&p->cnt[CNT_TX_QUEUE_FULL]);
+            break;
+        }
+        int64_t tb = PROF_NOW();
+        for (int ch = 0; ch < p->tx_count; ch++)
+            clipped += trx_lms_conv.f32_to_i16((int16_t*)buf[ch], (const float*)samples[ch] + done*2, n*2,
+                                               maxValue * s->tx_dgain[p->tx_ch0 + ch].load(std::memory_order_relaxed),
+                                               maxValue);
+        int64_t tc = PROF_NOW();
+        /* the last packet of a burst is sent without waiting for more */
+        trx_lms7002m_tx_send(p, buf, timestamp + done, n,
+                             done + n == count && (end || (flags&TRX_WRITE_FLAG_END_OF_BURST)));
+        int64_t td = PROF_NOW();
+        conv += tc - tb;
+        io += (tb - ta) + (td - tc);
+        done += n;
+    }
+    if (clipped)
+        trx_lms_count(&p->cnt[CNT_TX_CLIP], clipped);
+    PROF_CALL(&p->tx_prof, t0, io, conv, PROF_NOW());
+}
+
+static int trx_lms7002m_read_int(TRXState *s1, trx_timestamp_t *ptimestamp, void **psamples, int count, int port)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    TRXLmsPort *p = &s->port[port];
+    const float scale = s->rx_stream->dataFmt == lms_stream_t::LMS_FMT_I12 ? 1.0f/2048.0f : 1.0f/32768.0f;
+    /* 12 bit ADC full scale, LimeSuite shifts it up for 16b */
+    const int clip = s->rx_stream->dataFmt == lms_stream_t::LMS_FMT_I12 ? 2047 : 2047 << 4;
+
+    // First shot ?
+    if (!s->started.load(std::memory_order_acquire))
+        trx_lms7002m_start_streams(s);
+
+    if (p->ring) {
+        int64_t t0 = PROF_NOW(), wait = 0;
+        int ret = trx_lms7002m_ring_read(s, p, psamples, count, ptimestamp, scale, clip, &wait);
+        int64_t t1 = PROF_NOW();
+        PROF_CALL(&p->rx_prof, t0, wait, t1 - t0 - wait, t1);
+        trx_lms7002m_snapshot(s, p, psamples, ret, *ptimestamp);
+        return ret;
+    }
+
+    /* The int16 samples are received into the upper half of the caller's
+     * float buffers and expanded in place: converting forward, float i
+     * never overwrites an int16 not yet read (see trx_lms_i16_to_f32_c). */
+    void *raw[MAX_NUM_CH];
+    for (int ch = 0; ch < p->rx_count; ch++)
+        raw[ch] = (float*)psamples[ch] + count;
+
+    int64_t t0 = PROF_NOW();
+    int ret = trx_lms7002m_recv(p, raw, count, ptimestamp);
+    int64_t t1 = PROF_NOW();
+    if (ret <= 0)
+        return ret;
+    int clipped = 0;
+    for (int ch = 0; ch < p->rx_count; ch++)
+        clipped += trx_lms_conv.i16_to_f32((float*)psamples[ch], (const int16_t*)raw[ch], ret*2,
+                                           scale * s->rx_dgain[p->rx_ch0 + ch].load(std::memory_order_relaxed),
+                                           clip);
+    int64_t t2 = PROF_NOW();
+    if (clipped)
+        trx_lms_count(&p->cnt[CNT_RX_CLIP], clipped);
+    PROF_CALL(&p->rx_prof, t0, t1 - t0, t2 - t1, t2);
+    trx_lms7002m_snapshot(s, p, psamples, ret, *ptimestamp);
+
+    return ret;
+}
+
+void trx_lms7002m_write_int2(TRXState *s, trx_timestamp_t timestamp, const void **samples, int count, int port, TRXWriteMetadata *md)
+{
+    trx_lms7002m_write_md(s, port, md);
+    trx_lms7002m_write_int(s, timestamp, samples, count, md->flags, port);
+}
+int trx_lms7002m_read_int2(TRXState *s, trx_timestamp_t *ptimestamp, void **samples, int count, int port, TRXReadMetadata *md)
+{
+    return trx_lms7002m_read_int(s, ptimestamp, samples, count, port);
+}
+
+static int trx_lms7002m_get_sample_rate(TRXState *s1, TRXFraction *psample_rate,
+                                     int *psample_rate_num, int sample_rate_min)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+
+    // sample rate not specified, align on 1.92Mhz
+    if (s->sample_rate <= 0)
+    {
+        if (!s->ini_file)
+        {
+            int i, n;
+            static const char sample_rate_tab[] = {1,2,4,8,12,16};
+            for(i = 0; i < sizeof(sample_rate_tab); i++)
+            {
+                n = sample_rate_tab[i];
+                if (sample_rate_min <= n * 1920000)
+                {
+                    *psample_rate_num = n;
+                    psample_rate->num = n * 1920000;
+                    psample_rate->den = 1;
+                    s->sample_rate = psample_rate->num;
+                    printf("Automatic sample rate: %f MSps\n", (double)s->sample_rate/1e6);
+                    return 0;
+                }
+            }
+        }
+        else
+        {
+            double srate;
+            LMS_GetSampleRate(s->devices[0], LMS_CH_RX, 0, &srate, nullptr);
+	    printf("Use sample rate from INI file %f MSps\n", srate/1e6);
+            psample_rate->num = int(srate);
+            psample_rate->den = 1;
+            *psample_rate_num = 0;
+       	    return 0;
+        }
+
+    }
+    else
+    {
+        printf("Sample rate: %f MSps\n", (double)s->sample_rate/1e6);
+        psample_rate->num = s->sample_rate;
+        psample_rate->den = 1;
+        *psample_rate_num = 0;
+        return 0;
+    }
+    return -1;
+}
+
+/* Fold the LimeSuite stream status into the driver counters. LimeSuite
+   reports underrun/overrun/dropped packets since the previous query. */
+static void trx_lms7002m_fold_status(TRXLmsPort *p, bool tx, const lms_stream_status_t *st)
+{
+    if (tx) {
+        p->cnt[CNT_TX_UNDERRUN].val.fetch_add(st->underrun, std::memory_order_relaxed);
+        p->cnt[CNT_TX_DROPPED].val.fetch_add(st->droppedPackets, std::memory_order_relaxed);
+    } else {
+        p->cnt[CNT_RX_OVERRUN].val.fetch_add(st->overrun, std::memory_order_relaxed);
+        p->cnt[CNT_RX_DROPPED].val.fetch_add(st->droppedPackets, std::memory_order_relaxed);
+    }
+}
+
+static void trx_lms7002m_poll_status(TRXLmsState *s)
+{
+    lms_stream_status_t st;
+
+    if (!s->started.load(std::memory_order_acquire))
+        return;
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        for (int ch = 0; ch < p->tx_count; ch++)
+            if (LMS_GetStreamStatus(&p->tx_stream[ch], &st) == 0)
+                trx_lms7002m_fold_status(p, true, &st);
+        for (int ch = 0; ch < p->rx_count; ch++)
+            if (LMS_GetStreamStatus(&p->rx_stream[ch], &st) == 0)
+                trx_lms7002m_fold_status(p, false, &st);
+    }
+}
+
+/* Sum of a counter over all ports */
+static int64_t trx_lms7002m_counter(TRXLmsState *s, int idx)
+{
+    int64_t n = 0;
+    for (int i = 0; i < s->port_count; i++)
+        n += trx_lms_counter(&s->port[i].cnt[idx]);
+    return n;
+}
+
+static int trx_lms7002m_get_stats(TRXState *s1, TRXStatistics *m)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+
+    trx_lms7002m_poll_status(s);
+    m->tx_underflow_count = trx_lms7002m_counter(s, CNT_TX_UNDERRUN) +
+                            trx_lms7002m_counter(s, CNT_TX_LATE);
+    m->rx_overflow_count = trx_lms7002m_counter(s, CNT_RX_OVERRUN) +
+                           trx_lms7002m_counter(s, CNT_RX_DROPPED);
+    return 0;
+}
+
+#ifdef TRX_LMS_PROFILE
+static void trx_lms7002m_dump_prof(const char *dir, const TRXLmsProf *p, trx_printf_cb cb, void *opaque)
+{
+    for (int i = 0; i < PROF_COUNT; i++) {
+        const TRXLmsHist *h = &p->hist[i];
+        cb(opaque, "  %s_%-5s %10" PRIu64 " %9.1f %9.1f %9.1f %9.1f\n", dir, trx_lms_prof_names[i],
+           h->count.load(std::memory_order_relaxed),
+           trx_lms_hist_quantile(h, 0.5) / 1e3,
+           trx_lms_hist_quantile(h, 0.99) / 1e3,
+           trx_lms_hist_quantile(h, 0.999) / 1e3,
+           h->max.load(std::memory_order_relaxed) / 1e3);
+    }
+}
+#endif
+
+static void trx_lms7002m_dump_info(TRXState *s1, trx_printf_cb cb, void *opaque)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+
+    trx_lms7002m_poll_status(s);
+    cb(opaque, "LMS7002M: conversion=%s fifo=%d/%.2f next=%d/%.2f gain_coalesced=%d\n", trx_lms_conv.name,
+       s->fifo_size, s->fifo_tvl, s->fifo_next_size, s->fifo_next_tvl, s->gain_coalesced.load());
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        cb(opaque, " port %d: rx %d+%d tx %d+%d %.3f MSps\n ", i, p->rx_ch0, p->rx_count,
+           p->tx_ch0, p->tx_count, p->sample_rate / 1e6);
+        for (int j = 0; j < CNT_COUNT; j++)
+            cb(opaque, " %s=%" PRId64, trx_lms_counter_names[j], trx_lms_counter(&p->cnt[j]));
+        cb(opaque, "\n");
+        trx_timestamp_t cur;
+        if (trx_lms7002m_cur_timestamp(p, &cur) == 0)
+            cb(opaque, "  clock: cur_timestamp=%" PRId64 " rx_next=%" PRId64 " rx_lead=%" PRId64 "\n",
+               cur, p->rx_ts_next.load(), p->rx_lead.load());
+        if (p->ring) {
+            TRXLmsRing *r = p->ring;
+            int64_t depth = (int64_t)(r->head.load() - r->tail.load()) * r->block;
+            cb(opaque, "  rx_ring: depth=%" PRId64 " max=%" PRId64 " size=%d\n",
+               depth, r->depth_max.load(), r->slots * r->block);
+        }
+        if (p->txq) {
+            TRXLmsRing *q = p->txq;
+            cb(opaque, "  tx_queue: depth=%d/%d slots margin=%" PRId64 " min=%" PRId64 "\n",
+               (int)(q->head.load() - q->tail.load()), q->slots, p->tx_margin.load(),
+               p->tx_margin_min.load() == INT64_MAX ? 0 : p->tx_margin_min.load());
+        }
+        if (p->tdd.period)
+            cb(opaque, "  tdd: period=%" PRId64 " bursts=%d gate=%d phase=%" PRId64 "\n",
+               p->tdd.period, p->tdd.burst_count, p->tdd.gate, p->tdd.phase);
+#ifdef TRX_LMS_PROFILE
+        cb(opaque, "  %-8s %10s %9s %9s %9s %9s (us)\n", "latency", "count", "p50", "p99", "p99.9", "max");
+        trx_lms7002m_dump_prof("rx", &p->rx_prof, cb, opaque);
+        trx_lms7002m_dump_prof("tx", &p->tx_prof, cb, opaque);
+#endif
+    }
+}
+
+static int trx_lms7002m_get_tx_samples_per_packet_func(TRXState *s1)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+
+    /* a packet carries the channels of one board */
+    return (s->tx_stream->dataFmt == lms_stream_t::LMS_FMT_I12 ? 1360 : 1020)/s->tx_dev_ch;
+}
+
+ static int trx_lms7002m_get_abs_rx_power_func(TRXState *s1, float *presult, int channel_num)
+ {
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    if (s->rx_power_available)
+    {
+        *presult = s->rx_power;
+        printf("rx power %f\n", *presult);
+        return 0;
+    }
+    return -1;
+ }
+
+ static int trx_lms7002m_get_abs_tx_power_func(TRXState *s1, float *presult, int channel_num)
+ {
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    if (s->tx_power_available)
+    {
+        *presult = s->tx_power;
+        printf("tx power %f\n", *presult);
+        return 0;
+    }
+    return -1;
+ }
+
+
+
+/* Apply a gain in dB: steps within dgain_range of the programmed RF gain
+ * are only digital, no SPI access. Larger ones move the RF gain to the
+ * nearest dB and the digital gain keeps the remainder. */
+static int trx_lms7002m_set_gain(TRXLmsState *s, bool tx, int ch, double gain)
+{
+    if (ch < 0 || ch >= (tx ? s->tx_channel_count : s->rx_channel_count))
+        return -1;
+
+    double *rf = tx ? &s->tx_rf_gain[ch] : &s->rx_rf_gain[ch];
+    std::atomic<float> *dgain = tx ? &s->tx_dgain[ch] : &s->rx_dgain[ch];
+    if (fabs(gain - *rf) > s->dgain_range) {
+        double g = floor(gain + 0.5);
+        if (g < 0)
+            g = 0;
+        lms_device_t *dev = trx_lms_dev(s, tx, ch);
+        unsigned applied = g;
+        if (LMS_SetGaindB(dev, tx, trx_lms_chan(s, tx, ch), (unsigned)g) != 0)
+            return -1;
+        /* LimeSuite clamps to the chip range: the digital gain makes up
+           the difference and any overdrive shows in the clip counters */
+        LMS_GetGaindB(dev, tx, trx_lms_chan(s, tx, ch), &applied);
+        *rf = applied;
+    }
+    dgain->store(powf(10.0f, (float)(gain - *rf) / 20.0f), std::memory_order_relaxed);
+    return 0;
+}
+
+static void trx_lms7002m_ctrl_wake(TRXLmsState *s);
+
+/* Gain changes may come from any thread while streaming. They are posted
+ * in a per channel mailbox, where only the latest value is kept, and
+ * applied by the control thread: the caller never waits for the SPI. */
+static void trx_lms7002m_post_gain(TRXLmsState *s, bool tx, int ch, double gain)
+{
+    if (ch < 0 || ch >= MAX_NUM_CH || !s->ctrl_running) {
+        if (trx_lms7002m_set_gain(s, tx, ch, gain) != 0)
+            fprintf(stderr, "Failed to set %s gain\n", tx ? "Tx" : "Rx");
+        return;
+    }
+    std::atomic<double> *req = tx ? &s->tx_gain_req[ch] : &s->rx_gain_req[ch];
+    /* a pending value means the control thread was already woken */
+    if (std::isnan(req->exchange(gain, std::memory_order_acq_rel)))
+        trx_lms7002m_ctrl_wake(s);
+    else
+        s->gain_coalesced.fetch_add(1, std::memory_order_relaxed);
+}
+
+//min gain 0
+//max gain ~70-76 (higher will probably degrade signal quality to much)
+static void trx_lms7002m_set_tx_gain_func(TRXState *s1, double gain, int channel_num)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    trx_lms7002m_post_gain(s, LMS_CH_TX, channel_num, gain);
+}
+
+//min gain 0
+//max gain Rx: 73
+static void trx_lms7002m_set_rx_gain_func(TRXState *s1, double gain, int channel_num)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    trx_lms7002m_post_gain(s, LMS_CH_RX, channel_num, gain);
+}
+
+/*
+ * Retune
+ *
+ * LMS_SetLOFrequency runs the VCO and capacitor bank search of the SX
+ * synthesizer, tens of ms. For the frequencies of retune_freqs, start
+ * runs it once per board and keeps the resulting SX registers: a retune
+ * to one of them only writes these back, well under a ms. Other
+ * frequencies fall back to LMS_SetLOFrequency. The IQ/DC calibration is
+ * not redone.
+ */
+
+/* SX registers of the RX or TX synthesizer, selected by the MAC bits */
+static int trx_lms7002m_sx_access(lms_device_t *dev, bool tx, uint16_t *val, bool write)
+{
+    uint16_t mac;
+    int ret = 0;
+
+    if (LMS_ReadLMSReg(dev, 0x0020, &mac) != 0)
+        return -1;
+    ret |= LMS_WriteLMSReg(dev, 0x0020, (mac & ~3) | (tx ? 2 : 1));
+    for (int i = 0; i < SX_REG_COUNT && !ret; i++) {
+        if (write)
+            ret |= LMS_WriteLMSReg(dev, SX_REG_FIRST + i, val[i]);
+        else
+            ret |= LMS_ReadLMSReg(dev, SX_REG_FIRST + i, &val[i]);
+    }
+    ret |= LMS_WriteLMSReg(dev, 0x0020, mac);
+    return ret ? -1 : 0;
+}
+
+/* Called by start before the LOs are set to the configured frequencies */
+static int trx_lms7002m_tune_build(TRXLmsState *s)
+{
+    free(s->tune);
+    s->tune = NULL;
+    if (!s->tune_count)
+        return 0;
+    if (s->rx_dev_ch > 2 || s->tx_dev_ch > 2) {
+        fprintf(stderr, "retune_freqs: only the first LMS7002M is reachable, no retune table\n");
+        return 0;
+    }
+    TRXLmsTune *tune = (TRXLmsTune*)calloc(s->device_count * s->tune_count, sizeof(TRXLmsTune));
+    if (!tune)
+        return -1;
+    int64_t t0 = get_time_us();
+    for (int b = 0; b < s->device_count; b++) {
+        for (int i = 0; i < s->tune_count; i++) {
+            for (int tx = 0; tx < (s->tx_channel_count ? 2 : 1); tx++) {
+                if (LMS_SetLOFrequency(s->devices[b], tx, 0, s->tune_freq[i]) != 0 ||
+                    trx_lms7002m_sx_access(s->devices[b], tx, tune[b * s->tune_count + i].sx[tx], false) != 0) {
+                    fprintf(stderr, "retune_freqs: cannot tune %s to %.0f Hz\n", tx ? "Tx" : "Rx", s->tune_freq[i]);
+                    free(tune);
+                    return -1;
+                }
+            }
+        }
+    }
+    s->tune = tune;
+    printf("Retune table: %d frequencies in %.1f ms\n", s->tune_count, (get_time_us() - t0) / 1e3);
+    return 0;
+}
+
+/* Control thread only, like the other register accesses while started */
+static int trx_lms7002m_retune(TRXLmsState *s, bool tx, double freq, bool *cached)
+{
+    int i = 0;
+
+    while (s->tune && i < s->tune_count && fabs(s->tune_freq[i] - freq) >= 1)
+        i++;
+    *cached = s->tune && i < s->tune_count;
+    for (int b = 0; b < s->device_count; b++) {
+        if (*cached) {
+            if (trx_lms7002m_sx_access(s->devices[b], tx, s->tune[b * s->tune_count + i].sx[tx], true) != 0)
+                return -1;
+        } else {
+            for (int ch = 0; ch < (tx ? s->tx_dev_ch : s->rx_dev_ch); ch += 2)
+                if (LMS_SetLOFrequency(s->devices[b], tx, ch, freq) != 0)
+                    return -1;
+        }
+    }
+    if (tx)
+        s->tx_freq = freq;
+    else
+        s->rx_freq = freq;
+    return 0;
+}
+
+/*
+ * Remote API (trx_msg_recv_func)
+ *
+ * Messages carry a "cmd" string:
+ *   "stats"     stream status, FIFO fill levels and driver counters
+ *   "set_gain"  "dir" ("rx"/"tx"), "channel", "gain"
+ *   "capture"   "samples", "file", optional "port": snapshot of the next
+ *               received samples, written as interleaved cf32 to
+ *               <file>_ch<n>.cf32
+ *   "record"    "duration" (ms), "file", optional "port": starts recording
+ *               the port RX and TX in the stream format to SigMF files
+ *               <file>_rx<n>.sigmf-data/-meta, <file>_tx<n>..., replies
+ *               once started (needs record_ring_ms)
+ *   "retune"    "rx_freq" and/or "tx_freq" (Hz): moves the LOs of all
+ *               boards, from the retune table when the frequency is in
+ *               retune_freqs; replies the time it took and "cached"
+ * An optional "timeout" (ms, at most MSG_TIMEOUT_MAX_MS) bounds the wait
+ * for the result.
+ *
+ * The command is parsed in trx_msg_recv_func and executed by the control
+ * thread, never on the streaming threads. The reply is sent from the
+ * TRXMsg timeout callback, which polls until the job is done or its
+ * timeout expires, so the TRXMsg API is only used from the caller side.
+ */
+#define MSG_POLL_MS             5
+#define MSG_TIMEOUT_MS          1000
+#define MSG_TIMEOUT_MAX_MS      60000
+#define MSG_MAX_RESULTS         64
+#define MSG_CAPTURE_MAX         (16 * 1024 * 1024)
+#define CTRL_TICK_MS            1000
+#define CAPTURE_POLL_MS         1
+
+enum {
+    JOB_STATS,
+    JOB_SET_GAIN,
+    JOB_CAPTURE,
+    JOB_RECORD,
+    JOB_RETUNE,
+};
+
+enum {
+    JOB_PENDING,
+    JOB_DONE,
+    JOB_ABANDONED,
+};
+
+struct TRXLmsJob {
+    TRXLmsJob *next;
+    TRXLmsState *s;
+    int cmd;
+    bool tx;
+    int channel;
+    double gain;
+    int samples;
+    double duration;            /* ms */
+    double freq[2];             /* Hz, RX and TX, 0: unchanged */
+    int port;
+    char file[256];
+    int64_t deadline;           /* us */
+    std::atomic<int> state;
+    int result_count;
+    struct {
+        char name[32];
+        char str[256];
+        double val;
+        bool is_str;
+    } result[MSG_MAX_RESULTS];
+};
+
+static void trx_lms_job_double(TRXLmsJob *job, const char *name, double val)
+{
+    if (job->result_count >= MSG_MAX_RESULTS)
+        return;
+    snprintf(job->result[job->result_count].name, sizeof(job->result[0].name), "%s", name);
+    job->result[job->result_count].val = val;
+    job->result[job->result_count].is_str = false;
+    job->result_count++;
+}
+
+static void __attribute__ ((format (printf, 3, 4)))
+trx_lms_job_string(TRXLmsJob *job, const char *name, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (job->result_count >= MSG_MAX_RESULTS)
+        return;
+    snprintf(job->result[job->result_count].name, sizeof(job->result[0].name), "%s", name);
+    va_start(ap, fmt);
+    vsnprintf(job->result[job->result_count].str, sizeof(job->result[0].str), fmt, ap);
+    va_end(ap);
+    job->result[job->result_count].is_str = true;
+    job->result_count++;
+}
+
+static void trx_lms7002m_job_stats(TRXLmsState *s, TRXLmsJob *job)
+{
+    lms_stream_status_t st;
+    char name[32];
+
+    trx_lms7002m_poll_status(s);
+    trx_lms_job_double(job, "started", s->started);
+    trx_lms_job_double(job, "sample_rate", s->sample_rate);
+    trx_lms_job_double(job, "recording", s->rec_active.load());
+    trx_lms_job_double(job, "rx_freq", s->rx_freq);
+    trx_lms_job_double(job, "tx_freq", s->tx_freq);
+    for (int i = 0; i < CNT_COUNT; i++)
+        trx_lms_job_double(job, trx_lms_counter_names[i], trx_lms7002m_counter(s, i));
+    if (!s->started)
+        return;
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        for (int j = 0; j < p->rx_count + p->tx_count; j++) {
+            bool tx = j >= p->rx_count;
+            int ch = tx ? j - p->rx_count : j;
+            /* LimeSuite clears its counts on every query: keep them */
+            if (LMS_GetStreamStatus(tx ? &p->tx_stream[ch] : &p->rx_stream[ch], &st) != 0)
+                continue;
+            trx_lms7002m_fold_status(p, tx, &st);
+            ch += tx ? p->tx_ch0 : p->rx_ch0;
+            snprintf(name, sizeof(name), "%s%d_fifo_filled", tx ? "tx" : "rx", ch);
+            trx_lms_job_double(job, name, st.fifoFilledCount);
+            snprintf(name, sizeof(name), "%s%d_fifo_size", tx ? "tx" : "rx", ch);
+            trx_lms_job_double(job, name, st.fifoSize);
+            snprintf(name, sizeof(name), "%s%d_link_rate", tx ? "tx" : "rx", ch);
+            trx_lms_job_double(job, name, st.linkRate);
+        }
+        if (p->ring) {
+            TRXLmsRing *r = p->ring;
+            snprintf(name, sizeof(name), "port%d_rx_ring_depth", i);
+            trx_lms_job_double(job, name, (double)(r->head.load() - r->tail.load()) * r->block);
+            snprintf(name, sizeof(name), "port%d_rx_ring_max", i);
+            trx_lms_job_double(job, name, r->depth_max.load());
+        }
+        if (p->txq) {
+            snprintf(name, sizeof(name), "port%d_tx_queue_depth", i);
+            trx_lms_job_double(job, name, p->txq->head.load() - p->txq->tail.load());
+            snprintf(name, sizeof(name), "port%d_tx_margin", i);
+            trx_lms_job_double(job, name, p->tx_margin.load());
+        }
+    }
+}
+
+/* Arm a snapshot and return: the control thread keeps serving gains and
+   housekeeping while the RX thread fills it, see trx_lms7002m_capture_poll */
+static bool trx_lms7002m_job_capture(TRXLmsState *s, TRXLmsJob *job)
+{
+    TRXLmsSnapshot *snap = &s->snapshot;
+    int nch = s->port[job->port].rx_count;
+    bool ok = true;
+
+    if (!s->started) {
+        trx_lms_job_string(job, "error", "not started");
+        return true;
+    }
+    if (s->capture_job) {
+        trx_lms_job_string(job, "error", "capture in progress");
+        return true;
+    }
+    for (int ch = 0; ch < nch; ch++) {
+        snap->buf[ch] = (float*)malloc(job->samples * 2 * sizeof(float));
+        ok &= snap->buf[ch] != NULL;
+    }
+    if (!ok) {
+        trx_lms_job_string(job, "error", "out of memory");
+        for (int ch = 0; ch < nch; ch++) {
+            free(snap->buf[ch]);
+            snap->buf[ch] = NULL;
+        }
+        return true;
+    }
+    snap->port.store(job->port);
+    snap->count = job->samples;
+    snap->filled = 0;
+    s->capture_job = job;
+    snap->armed.store(1, std::memory_order_release);
+    return false;
+}
+
+/* Write out the snapshot once filled, or fail it at its deadline */
+static void trx_lms7002m_capture_end(TRXLmsState *s, TRXLmsJob *job)
+{
+    TRXLmsSnapshot *snap = &s->snapshot;
+    int nch = s->port[job->port].rx_count;
+    bool ok = true;
+
+    /* disarm and wait for the RX thread to leave the buffers */
+    snap->armed.store(0);
+    while (snap->busy.load())
+        sched_yield();
+
+    if (snap->filled < snap->count) {
+        trx_lms_job_string(job, "error", "timeout after %d samples", snap->filled);
+    } else {
+        for (int ch = 0; ch < nch && ok; ch++) {
+            char path[300];
+            snprintf(path, sizeof(path), "%s_ch%d.cf32", job->file, ch);
+            FILE *f = fopen(path, "wb");
+            ok = f && fwrite(snap->buf[ch], 2 * sizeof(float), snap->count, f) == (size_t)snap->count;
+            if (f)
+                fclose(f);
+            if (!ok)
+                trx_lms_job_string(job, "error", "cannot write %s", path);
+        }
+        if (ok) {
+            trx_lms_job_double(job, "timestamp", snap->timestamp);
+            trx_lms_job_double(job, "samples", snap->count);
+            trx_lms_job_string(job, "file", "%s", job->file);
+        }
+    }
+    for (int ch = 0; ch < nch; ch++) {
+        free(snap->buf[ch]);
+        snap->buf[ch] = NULL;
+    }
+}
+
+static void trx_lms7002m_job_record(TRXLmsState *s, TRXLmsJob *job)
+{
+    if (!s->started) {
+        trx_lms_job_string(job, "error", "not started");
+        return;
+    }
+    int64_t samples = (int64_t)(job->duration * s->port[job->port].sample_rate / 1000);
+    const char *err = trx_lms7002m_rec_open(s, job->port, samples, job->file);
+    if (err) {
+        trx_lms_job_string(job, "error", "%s", err);
+        return;
+    }
+    trx_lms_job_double(job, "samples", samples);
+    trx_lms_job_string(job, "file", "%s", job->file);
+}
+
+static void trx_lms7002m_job_retune(TRXLmsState *s, TRXLmsJob *job)
+{
+    bool cached = true, c;
+
+    if (!s->started) {
+        trx_lms_job_string(job, "error", "not started");
+        return;
+    }
+    int64_t t0 = get_time_us();
+    for (int tx = 0; tx < 2; tx++) {
+        if (job->freq[tx] <= 0)
+            continue;
+        if (trx_lms7002m_retune(s, tx, job->freq[tx], &c) != 0) {
+            trx_lms_job_string(job, "error", "Failed to set %s frequency", tx ? "Tx" : "Rx");
+            return;
+        }
+        cached &= c;
+    }
+    trx_lms_job_double(job, "retune_us", get_time_us() - t0);
+    trx_lms_job_double(job, "cached", cached);
+    trx_lms_job_double(job, "rx_freq", s->rx_freq);
+    trx_lms_job_double(job, "tx_freq", s->tx_freq);
+}
+
+/* Returns false when the job goes on in the background */
+static bool trx_lms7002m_job_run(TRXLmsState *s, TRXLmsJob *job)
+{
+    switch (job->cmd) {
+    case JOB_STATS:
+        trx_lms7002m_job_stats(s, job);
+        break;
+    case JOB_SET_GAIN:
+        if (trx_lms7002m_set_gain(s, job->tx, job->channel, job->gain) != 0)
+            trx_lms_job_string(job, "error", "Failed to set %s gain", job->tx ? "Tx" : "Rx");
+        else
+            trx_lms_job_double(job, "gain", job->gain);
+        break;
+    case JOB_CAPTURE:
+        return trx_lms7002m_job_capture(s, job);
+    case JOB_RECORD:
+        trx_lms7002m_job_record(s, job);
+        break;
+    case JOB_RETUNE:
+        trx_lms7002m_job_retune(s, job);
+        break;
+    }
+    return true;
+}
+
+/* Hand the result over to the requester, unless it gave up */
+static void trx_lms7002m_job_done(TRXLmsJob *job)
+{
+    int state = JOB_PENDING;
+    if (!job->state.compare_exchange_strong(state, JOB_DONE))
+        delete job;
+}
+
+/* Completion of the armed capture, checked on every pass of the control
+   loop */
+static void trx_lms7002m_capture_poll(TRXLmsState *s)
+{
+    TRXLmsJob *job = s->capture_job;
+
+    if (!job)
+        return;
+    if (s->snapshot.armed.load() && get_time_us() < job->deadline && !s->ctrl_stop)
+        return;
+    trx_lms7002m_capture_end(s, job);
+    s->capture_job = NULL;
+    trx_lms7002m_job_done(job);
+}
+
+/* How far the board clock is ahead of the received data: samples in
+   flight and in the RX FIFO, from the stream status timestamp */
+static void trx_lms7002m_rx_lead(TRXLmsState *s)
+{
+    lms_stream_status_t st;
+
+    if (!s->started.load(std::memory_order_acquire))
+        return;
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        if (!p->rx_count || LMS_GetStreamStatus(&p->rx_stream[0], &st) != 0)
+            continue;
+        trx_lms7002m_fold_status(p, false, &st);
+        int64_t next = p->rx_ts_next.load(std::memory_order_relaxed);
+        if (!st.timestamp || !next)
+            continue;
+        int64_t lead = (int64_t)st.timestamp - p->dev_ts_offset[p->rx_dev[0]].load() - next;
+        if (lead < 0)
+            lead = 0;
+        int64_t old = p->rx_lead.load(std::memory_order_relaxed);
+        p->rx_lead.store(old ? (3 * old + lead) / 4 : lead, std::memory_order_relaxed);
+    }
+}
+
+/* Adaptive FIFO: grow on underruns/overruns, shrink after a long error
+   free period with a mostly empty TX FIFO. Saved for the next start. */
+static void trx_lms7002m_fifo_tick(TRXLmsState *s)
+{
+    lms_stream_status_t st;
+
+    if (s->fifo_mode != TRXLmsState::FIFO_AUTO || !s->started.load(std::memory_order_acquire))
+        return;
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *p = &s->port[i];
+        if (!p->tx_count || LMS_GetStreamStatus(&p->tx_stream[0], &st) != 0)
+            continue;
+        trx_lms7002m_fold_status(p, true, &st);
+        if (st.fifoSize) {
+            float fill = (float)st.fifoFilledCount / st.fifoSize;
+            if (fill > s->fifo_fill_max)
+                s->fifo_fill_max = fill;
+        }
+    }
+
+    int64_t errors = trx_lms7002m_counter(s, CNT_TX_UNDERRUN) + trx_lms7002m_counter(s, CNT_RX_OVERRUN);
+    int size = s->fifo_next_size;
+    float tvl = s->fifo_next_tvl;
+    if (s->fifo_warmup < FIFO_WARMUP_TICKS) {
+        s->fifo_warmup++;
+        s->fifo_errors = errors;
+        return;
+    }
+    if (errors != s->fifo_errors) {
+        s->fifo_errors = errors;
+        s->fifo_quiet_ticks = 0;
+        if (size < FIFO_MAX)
+            size *= 2;
+        tvl = tvl + 0.1f < 1.0f ? tvl + 0.1f : 1.0f;
+    } else if (++s->fifo_quiet_ticks >= FIFO_RELAX_TICKS) {
+        if (s->fifo_fill_max < 0.25f && size > FIFO_MIN)
+            size /= 2;
+        tvl = tvl - 0.05f > 0.0f ? tvl - 0.05f : 0.0f;
+        s->fifo_quiet_ticks = 0;
+        s->fifo_fill_max = 0;
+    }
+    if (size == s->fifo_next_size && tvl == s->fifo_next_tvl)
+        return;
+    s->fifo_next_size = size;
+    s->fifo_next_tvl = tvl;
+    printf("FIFO: %d samples, throughput/latency %.2f from next start\n", size, tvl);
+    if (s->fifo_state_file) {
+        FILE *f = fopen(s->fifo_state_file, "w");
+        if (f) {
+            fprintf(f, "%d %.2f\n", size, tvl);
+            fclose(f);
+        }
+    }
+}
+
+/* Periodic housekeeping, every CTRL_TICK_MS */
+static void trx_lms7002m_ctrl_tick(TRXLmsState *s)
+{
+    trx_lms7002m_rx_lead(s);
+    trx_lms7002m_fifo_tick(s);
+    if (s->device_count > 1)
+        trx_lms7002m_check_devices(s);
+}
+
+/* Apply the pending gain requests, the latest one of each channel */
+static void trx_lms7002m_ctrl_gains(TRXLmsState *s)
+{
+    for (int tx = 0; tx < 2; tx++) {
+        for (int ch = 0; ch < MAX_NUM_CH; ch++) {
+            std::atomic<double> *req = tx ? &s->tx_gain_req[ch] : &s->rx_gain_req[ch];
+            if (std::isnan(req->load(std::memory_order_relaxed)))
+                continue;
+            double gain = req->exchange(NAN, std::memory_order_acquire);
+            if (trx_lms7002m_set_gain(s, tx, ch, gain) != 0)
+                fprintf(stderr, "Failed to set %s gain\n", tx ? "Tx" : "Rx");
+        }
+    }
+}
+
+static void *trx_lms7002m_ctrl_thread(void *arg)
+{
+    TRXLmsState *s = (TRXLmsState*)arg;
+    struct pollfd pfd = { s->ctrl_event, POLLIN, 0 };
+    int64_t tick = get_time_us() + CTRL_TICK_MS * 1000LL;
+
+    while (!s->ctrl_stop) {
+        int64_t wait = tick - get_time_us();
+        if (s->capture_job && wait > CAPTURE_POLL_MS * 1000LL)
+            wait = CAPTURE_POLL_MS * 1000LL;
+        if (poll(&pfd, 1, wait > 0 ? (int)((wait + 999) / 1000) : 0) > 0) {
+            uint64_t n;
+            if (read(s->ctrl_event, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                break;
+        }
+        if (s->ctrl_stop)
+            break;
+
+        /* gains first: they are the latency sensitive part */
+        trx_lms7002m_ctrl_gains(s);
+
+        for (;;) {
+            pthread_mutex_lock(&s->ctrl_lock);
+            TRXLmsJob *job = s->ctrl_jobs;
+            if (job)
+                s->ctrl_jobs = job->next;
+            pthread_mutex_unlock(&s->ctrl_lock);
+            if (!job)
+                break;
+
+            if (trx_lms7002m_job_run(s, job))
+                trx_lms7002m_job_done(job);
+            trx_lms7002m_ctrl_gains(s);
+        }
+        trx_lms7002m_capture_poll(s);
+
+        int64_t now = get_time_us();
+        if (now >= tick) {
+            trx_lms7002m_ctrl_tick(s);
+            tick += CTRL_TICK_MS * 1000LL;
+            if (tick < now)
+                tick = now + CTRL_TICK_MS * 1000LL;     /* a long job, skip */
+        }
+    }
+    trx_lms7002m_capture_poll(s);      /* fails it, ctrl_stop is set */
+    return NULL;
+}
+
+/* Never blocks: an eventfd write only adds to its counter */
+static void trx_lms7002m_ctrl_wake(TRXLmsState *s)
+{
+    uint64_t one = 1;
+    if (write(s->ctrl_event, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Cannot wake control thread: %s\n", strerror(errno));
+}
+
+static void trx_lms7002m_ctrl_init(TRXLmsState *s)
+{
+    for (int ch = 0; ch < MAX_NUM_CH; ch++) {
+        s->rx_gain_req[ch] = NAN;
+        s->tx_gain_req[ch] = NAN;
+    }
+    pthread_mutex_init(&s->ctrl_lock, NULL);
+    s->ctrl_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->ctrl_event < 0) {
+        fprintf(stderr, "Cannot create control event: %s\n", strerror(errno));
+        return;
+    }
+    if (pthread_create(&s->ctrl_thread, NULL, trx_lms7002m_ctrl_thread, s) != 0) {
+        fprintf(stderr, "Cannot create control thread\n");
+        close(s->ctrl_event);
+        return;
+    }
+    pthread_setname_np(s->ctrl_thread, "trx_lms_ctrl");
+    s->ctrl_running = true;
+}
+
+static void trx_lms7002m_ctrl_end(TRXLmsState *s)
+{
+    if (!s->ctrl_running)
+        return;
+    s->ctrl_stop = true;
+    trx_lms7002m_ctrl_wake(s);
+    pthread_join(s->ctrl_thread, NULL);
+    s->ctrl_running = false;
+    close(s->ctrl_event);
+
+    /* jobs still queued belong to requesters that have been answered */
+    while (s->ctrl_jobs) {
+        TRXLmsJob *job = s->ctrl_jobs;
+        s->ctrl_jobs = job->next;
+        trx_lms7002m_job_done(job);
+    }
+}
+
+static void trx_lms7002m_ctrl_queue(TRXLmsState *s, TRXLmsJob *job)
+{
+    TRXLmsJob **pj;
+
+    pthread_mutex_lock(&s->ctrl_lock);
+    for (pj = &s->ctrl_jobs; *pj; pj = &(*pj)->next);
+    *pj = job;
+    pthread_mutex_unlock(&s->ctrl_lock);
+    trx_lms7002m_ctrl_wake(s);
+}
+
+static void trx_lms7002m_msg_poll(TRXMsg *msg)
+{
+    TRXLmsJob *job = (TRXLmsJob*)msg->user_data;
+
+    if (job->state.load() != JOB_DONE) {
+        if (get_time_us() < job->deadline) {
+            msg->set_timeout(msg, trx_lms7002m_msg_poll, MSG_POLL_MS);
+            return;
+        }
+        int state = JOB_PENDING;
+        if (job->state.compare_exchange_strong(state, JOB_ABANDONED)) {
+            /* the control thread frees it */
+            msg->set_string(msg, "error", "timeout");
+            msg->send(msg);
+            return;
+        }
+    }
+    for (int i = 0; i < job->result_count; i++) {
+        if (job->result[i].is_str)
+            msg->set_string(msg, job->result[i].name, job->result[i].str);
+        else
+            msg->set_double(msg, job->result[i].name, job->result[i].val);
+    }
+    msg->send(msg);
+    delete job;
+}
+
+static void trx_lms7002m_msg_recv(TRXState *s1, TRXMsg *msg)
+{
+    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    const char *cmd, *str;
+    double val, timeout = MSG_TIMEOUT_MS;
+    TRXLmsJob *job;
+
+    if (msg->get_string(msg, &cmd, "cmd") < 0) {
+        msg->set_string(msg, "error", "missing cmd");
+        msg->send(msg);
+        return;
+    }
+    if (!s->ctrl_running) {
+        msg->set_string(msg, "error", "not started");
+        msg->send(msg);
+        return;
+    }
+
+    job = new TRXLmsJob();
+    job->s = s;
+    if (!strcmp(cmd, "stats")) {
+        job->cmd = JOB_STATS;
+    } else if (!strcmp(cmd, "set_gain")) {
+        job->cmd = JOB_SET_GAIN;
+        if (msg->get_string(msg, &str, "dir") < 0 ||
+            msg->get_double(msg, &val, "channel") < 0 ||
+            msg->get_double(msg, &job->gain, "gain") < 0) {
+            msg->set_string(msg, "error", "set_gain needs dir, channel and gain");
+            goto fail;
+        }
+        job->tx = !strcasecmp(str, "tx");
+        job->channel = val;
+        if (job->channel < 0 || job->channel >= (job->tx ? s->tx_channel_count : s->rx_channel_count)) {
+            msg->set_string(msg, "error", "invalid channel");
+            goto fail;
+        }
+    } else if (!strcmp(cmd, "capture")) {
+        job->cmd = JOB_CAPTURE;
+        timeout = 10000;
+        if (msg->get_double(msg, &val, "samples") < 0 || val <= 0 || val > MSG_CAPTURE_MAX ||
+            msg->get_string(msg, &str, "file") < 0) {
+            msg->set_string(msg, "error", "capture needs samples and file");
+            goto fail;
+        }
+        job->samples = val;
+        snprintf(job->file, sizeof(job->file), "%s", str);
+        if (msg->get_double(msg, &val, "port") >= 0)
+            job->port = val;
+        if (job->port < 0 || job->port >= s->port_count) {
+            msg->set_string(msg, "error", "invalid port");
+            goto fail;
+        }
+    } else if (!strcmp(cmd, "record")) {
+        job->cmd = JOB_RECORD;
+        if (msg->get_double(msg, &job->duration, "duration") < 0 || job->duration <= 0 ||
+            msg->get_string(msg, &str, "file") < 0) {
+            msg->set_string(msg, "error", "record needs duration and file");
+            goto fail;
+        }
+        snprintf(job->file, sizeof(job->file), "%s", str);
+        if (msg->get_double(msg, &val, "port") >= 0)
+            job->port = val;
+        if (job->port < 0 || job->port >= s->port_count) {
+            msg->set_string(msg, "error", "invalid port");
+            goto fail;
+        }
+    } else if (!strcmp(cmd, "retune")) {
+        job->cmd = JOB_RETUNE;
+        if (msg->get_double(msg, &val, "rx_freq") >= 0)
+            job->freq[0] = val;
+        if (msg->get_double(msg, &val, "tx_freq") >= 0)
+            job->freq[1] = val;
+        if (job->freq[0] <= 0 && job->freq[1] <= 0) {
+            msg->set_string(msg, "error", "retune needs rx_freq or tx_freq");
+            goto fail;
+        }
+        if (job->freq[1] > 0 && !s->tx_channel_count) {
+            msg->set_string(msg, "error", "no TX channel");
+            goto fail;
+        }
+    } else {
+        msg->set_string(msg, "error", "unknown cmd");
+        goto fail;
+    }
+    if (msg->get_double(msg, &val, "timeout") >= 0 && val > 0)
+        timeout = val < MSG_TIMEOUT_MAX_MS ? val : MSG_TIMEOUT_MAX_MS;
+
+    job->deadline = get_time_us() + (int64_t)(timeout * 1000);
+    job->state.store(JOB_PENDING);
+    msg->user_data = job;
+    trx_lms7002m_ctrl_queue(s, job);
+    msg->set_timeout(msg, trx_lms7002m_msg_poll, MSG_POLL_MS);
+    return;
+
+ fail:
+    delete job;
+    msg->send(msg);
+}
+
+/* Initial FIFO of the auto mode: a few ms of samples depending on the
+ * link, and a throughput/latency trade off following the link load */
+static void trx_lms7002m_fifo_init(TRXLmsState *s, const int *dev_rate)
+{
+    double load_max = 0;
+    double fifo_ms, link_rate;
+
+    if (strstr(s->link, "PCIe")) {
+        fifo_ms = 2;
+        link_rate = 245.76e6;
+    } else if (strstr(s->link, "USB 2")) {
+        fifo_ms = 8;
+        link_rate = 15.36e6;
+    } else {
+        fifo_ms = 4;
+        link_rate = 61.44e6;
+    }
+    for (int b = 0; b < s->device_count; b++) {
+        int ch = s->rx_dev_ch > s->tx_dev_ch ? s->rx_dev_ch : s->tx_dev_ch;
+        double load = (double)dev_rate[b] * ch / link_rate;
+        if (load > load_max)
+            load_max = load;
+    }
+    int rate = 0;
+    for (int b = 0; b < s->device_count; b++)
+        if (dev_rate[b] > rate)
+            rate = dev_rate[b];
+
+    int size = FIFO_MIN;
+    while (size < rate * fifo_ms / 1000 && size < FIFO_MAX)
+        size *= 2;
+    s->fifo_size = size;
+    s->fifo_tvl = 0.1f + 0.9f * (load_max < 1 ? load_max : 1);
+
+    /* adapted by a previous run */
+    if (s->fifo_state_file) {
+        FILE *f = fopen(s->fifo_state_file, "r");
+        int fsize;
+        float ftvl;
+        if (f) {
+            if (fscanf(f, "%d %f", &fsize, &ftvl) == 2 && fsize >= FIFO_MIN &&
+                fsize <= FIFO_MAX && ftvl >= 0 && ftvl <= 1) {
+                s->fifo_size = fsize;
+                s->fifo_tvl = ftvl;
+            }
+            fclose(f);
+        }
     }
+}
 
-    int ret;
-    for (int ch = 0; ch < s->rx_channel_count; ch++)
-    	ret = LMS_RecvStream(&s->rx_stream[ch],rx_buffers[ch],count,&meta,30);
-
-    for (int ch = 0; ch < s->rx_channel_count; ch++)
-    	for (int i = 0; i < count*2; i++)
-	    ((float*)psamples[ch])[i] = rx_buffers[ch][i]/maxValue;
+/*
+ * Calibration cache
+ *
+ * LMS_SetLPFBW and LMS_Calibrate leave their results in the LMS7002M
+ * registers: TRF/TBB/RFE/RBB (LPF, gains), TxTSP/RxTSP (IQ and DC
+ * corrections) and DCCAL. They are saved per board after a calibration,
+ * in <cache>/lms7002m_<serial>_<key hash>.cal, and written back at the
+ * next start with the same key instead of calibrating again.
+ */
+static const struct {
+    uint16_t first, last;
+} trx_lms_cal_regs[] = {
+    { 0x0100, 0x011A },
+    { 0x0200, 0x020C },
+    { 0x0400, 0x040D },
+    { 0x05C0, 0x05CC },
+};
 
-    *ptimestamp = meta.timestamp;
+#define CAL_REG_COUNT   67          /* registers in trx_lms_cal_regs */
 
-    return ret;
-}
+struct TRXLmsCal {
+    uint16_t val[2][CAL_REG_COUNT]; /* MAC A, MAC B */
+};
 
-void trx_lms7002m_write_int2(TRXState *s, trx_timestamp_t timestamp, const void **samples, int count, int port, TRXWriteMetadata *md)
-{
-    trx_lms7002m_write_int(s, timestamp, samples, count, md->flags, port);
-}
-int trx_lms7002m_read_int2(TRXState *s, trx_timestamp_t *ptimestamp, void **samples, int count, int port, TRXReadMetadata *md)
+static void trx_lms7002m_cal_key(TRXLmsState *s, const TRXDriverParams *p, int b,
+                                 char *key, int size, char *path, int path_size)
 {
-    return trx_lms7002m_read_int(s, ptimestamp, samples, count, port);
+    const lms_dev_info_t *info = LMS_GetDeviceInfo(s->devices[b]);
+    uint64_t serial = info ? info->boardSerialNumber : 0;
+    float_type temp = 0;
+    int len;
+
+    LMS_GetChipTemperature(s->devices[b], 0, &temp);
+    len = snprintf(key, size, "serial=%016" PRIx64 " cal=%d rx=%.0f tx=%.0f rxbw=%.0f txbw=%.0f temp=%d",
+                   serial, s->calibrate & ~CALIBRATE_FORCE, (double)p->rx_freq[0], (double)p->tx_freq[0],
+                   (double)p->rx_bandwidth[0], (double)p->tx_bandwidth[0],
+                   (int)floor(temp / CAL_TEMP_STEP) * CAL_TEMP_STEP);
+    for (int ch = 0; ch < s->rx_channel_count && len < size; ch++)
+        if (trx_lms_dev_index(s, LMS_CH_RX, ch) == b)
+            len += snprintf(key + len, size - len, " rxg%d=%.0f", ch, s->rx_rf_gain[ch]);
+    for (int ch = 0; ch < s->tx_channel_count && len < size; ch++)
+        if (trx_lms_dev_index(s, LMS_CH_TX, ch) == b)
+            len += snprintf(key + len, size - len, " txg%d=%.0f", ch, s->tx_rf_gain[ch]);
+
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *c = key; *c; c++)
+        h = (h ^ (uint8_t)*c) * 0x100000001b3ULL;
+    snprintf(path, path_size, "%s/lms7002m_%016" PRIx64 "_%016" PRIx64 ".cal", s->cal_cache, serial, h);
 }
 
-static int trx_lms7002m_get_sample_rate(TRXState *s1, TRXFraction *psample_rate,
-                                     int *psample_rate_num, int sample_rate_min)
+/* Register 0x0020 bits 0-1 select the MAC channel of the accesses */
+static int trx_lms7002m_cal_access(lms_device_t *dev, TRXLmsCal *cal, bool write)
 {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
+    uint16_t mac;
+    int ret = 0;
 
-    // sample rate not specified, align on 1.92Mhz
-    if (s->sample_rate <= 0)
-    {
-        if (!s->ini_file)
-        {
-            int i, n;
-            static const char sample_rate_tab[] = {1,2,4,8,12,16};
-            for(i = 0; i < sizeof(sample_rate_tab); i++)
-            {
-                n = sample_rate_tab[i];
-                if (sample_rate_min <= n * 1920000)
-                {
-                    *psample_rate_num = n;
-                    psample_rate->num = n * 1920000;
-                    psample_rate->den = 1;
-                    s->sample_rate = psample_rate->num;
-                    printf("Automatic sample rate: %f MSps\n", (double)s->sample_rate/1e6);
-                    return 0;
-                }
+    if (LMS_ReadLMSReg(dev, 0x0020, &mac) != 0)
+        return -1;
+    for (int m = 0; m < 2 && !ret; m++) {
+        int n = 0;
+        ret |= LMS_WriteLMSReg(dev, 0x0020, (mac & ~3) | (m + 1));
+        for (unsigned r = 0; r < sizeof(trx_lms_cal_regs) / sizeof(trx_lms_cal_regs[0]); r++) {
+            for (int a = trx_lms_cal_regs[r].first; a <= trx_lms_cal_regs[r].last; a++, n++) {
+                if (write)
+                    ret |= LMS_WriteLMSReg(dev, a, cal->val[m][n]);
+                else
+                    ret |= LMS_ReadLMSReg(dev, a, &cal->val[m][n]);
             }
         }
-        else
-        {
-            double srate;
-            LMS_GetSampleRate(s->device, LMS_CH_RX, 0, &srate, nullptr);
-	    printf("Use sample rate from INI file %f MSps\n", srate/1e6);
-            psample_rate->num = int(srate);
-            psample_rate->den = 1;
-            *psample_rate_num = 0;
-       	    return 0;
-        }
-
-    }
-    else
-    {
-        printf("Sample rate: %f MSps\n", (double)s->sample_rate/1e6);
-        psample_rate->num = s->sample_rate;
-        psample_rate->den = 1;
-        *psample_rate_num = 0;
-        return 0;
     }
-    return -1;
+    ret |= LMS_WriteLMSReg(dev, 0x0020, mac);
+    return ret ? -1 : 0;
 }
 
-static int trx_lms7002m_get_tx_samples_per_packet_func(TRXState *s1)
+static int trx_lms7002m_cal_read(TRXLmsState *s, const char *path, const char *key, TRXLmsCal *cal)
 {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
-
-    return (s->tx_stream->dataFmt == lms_stream_t::LMS_FMT_I12 ? 1360 : 1020)/s->tx_channel_count;
-}
+    char line[512];
+    long long saved = 0;
+    int n = 0;
+    FILE *f = fopen(path, "r");
 
- static int trx_lms7002m_get_abs_rx_power_func(TRXState *s1, float *presult, int channel_num)
- {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
-    if (s->rx_power_available)
-    {
-        *presult = s->rx_power;
-        printf("rx power %f\n", *presult);
-        return 0;
+    if (!f)
+        return -1;
+    if (!fgets(line, sizeof(line), f) || strncmp(line, "key ", 4) ||
+        strncmp(line + 4, key, strlen(key)) || line[4 + strlen(key)] != '\n' ||
+        fscanf(f, "time %lld\n", &saved) != 1) {
+        fclose(f);
+        return -1;
     }
-    return -1;
- }
-
- static int trx_lms7002m_get_abs_tx_power_func(TRXState *s1, float *presult, int channel_num)
- {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
-    if (s->tx_power_available)
-    {
-        *presult = s->tx_power;
-        printf("tx power %f\n", *presult);
-        return 0;
+    for (int m = 0; m < 2; m++) {
+        for (int i = 0; i < CAL_REG_COUNT; i++) {
+            unsigned v;
+            if (fscanf(f, "%x", &v) != 1)
+                break;
+            cal->val[m][i] = v;
+            n++;
+        }
     }
-    return -1;
- }
-
-
+    fclose(f);
+    if (n != 2 * CAL_REG_COUNT)
+        return -1;
+    if (time(NULL) - saved > s->cal_max_age) {
+        printf("Calibration cache: %s is stale\n", path);
+        return -1;
+    }
+    return 0;
+}
 
-//min gain 0
-//max gain ~70-76 (higher will probably degrade signal quality to much)
-static void trx_lms7002m_set_tx_gain_func(TRXState *s1, double gain, int channel_num)
+/* All boards or none, a partly restored MIMO setup would not match */
+static int trx_lms7002m_cal_restore(TRXLmsState *s, const TRXDriverParams *p)
 {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
-    if (LMS_SetGaindB(s->device, LMS_CH_TX, channel_num, gain)!=0)
-        fprintf(stderr, "Failed to set Tx gain\n");
+    TRXLmsCal cal[MAX_NUM_DEV];
+    char key[256], path[512];
+
+    if (s->rx_dev_ch > 2 || s->tx_dev_ch > 2)
+        return -1;      /* only the first LMS7002M is reachable */
+    for (int b = 0; b < s->device_count; b++) {
+        trx_lms7002m_cal_key(s, p, b, key, sizeof(key), path, sizeof(path));
+        if (trx_lms7002m_cal_read(s, path, key, &cal[b]) != 0)
+            return -1;
+    }
+    for (int b = 0; b < s->device_count; b++) {
+        if (trx_lms7002m_cal_access(s->devices[b], &cal[b], true) != 0) {
+            fprintf(stderr, "Calibration cache: cannot restore board %d\n", b);
+            return -1;
+        }
+    }
+    printf("Calibration restored from %s\n", s->cal_cache);
+    return 0;
 }
 
-//min gain 0
-//max gain Rx: 73
-static void trx_lms7002m_set_rx_gain_func(TRXState *s1, double gain, int channel_num)
+static void trx_lms7002m_cal_store(TRXLmsState *s, const TRXDriverParams *p)
 {
-    TRXLmsState *s = (TRXLmsState*)s1->opaque;
-    if (LMS_SetGaindB(s->device, LMS_CH_RX, channel_num, gain)!=0)
-        fprintf(stderr, "Failed to set Rx gain\n");
+    TRXLmsCal cal;
+    char key[256], path[512], tmp[520];
+
+    if (s->rx_dev_ch > 2 || s->tx_dev_ch > 2)
+        return;
+    for (int b = 0; b < s->device_count; b++) {
+        trx_lms7002m_cal_key(s, p, b, key, sizeof(key), path, sizeof(path));
+        if (trx_lms7002m_cal_access(s->devices[b], &cal, false) != 0)
+            continue;
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        FILE *f = fopen(tmp, "w");
+        if (!f) {
+            fprintf(stderr, "Calibration cache: cannot write %s\n", tmp);
+            continue;
+        }
+        fprintf(f, "key %s\ntime %lld\n", key, (long long)time(NULL));
+        for (int m = 0; m < 2; m++)
+            for (int i = 0; i < CAL_REG_COUNT; i++)
+                fprintf(f, "%04x%c", cal.val[m][i], i % 8 == 7 || i == CAL_REG_COUNT - 1 ? '\n' : ' ');
+        if (fclose(f) != 0 || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
 }
 
 static int trx_lms7002m_start(TRXState *s1, const TRXDriverParams *p)
 {
     TRXLmsState *s = (TRXLmsState*)s1->opaque;
 
-    if (p->rf_port_count != 1) {
-        fprintf(stderr, "Only one port allowed\n");
+    if (p->rf_port_count < 1 || p->rf_port_count > MAX_NUM_PORT) {
+        fprintf(stderr, "Unsupported number of RF ports: %d\n", p->rf_port_count);
+        return -1;
+    }
+    if (p->rx_channel_count > MAX_NUM_CH || p->tx_channel_count > MAX_NUM_CH) {
+        fprintf(stderr, "At most %d channels supported\n", MAX_NUM_CH);
         return -1;
     }
 
     s->tx_channel_count = p->tx_channel_count;
     s->rx_channel_count = p->rx_channel_count;
 
+    /* Channels are spread evenly over the boards */
+    if (s->rx_channel_count % s->device_count || s->tx_channel_count % s->device_count ||
+        s->rx_channel_count < s->device_count) {
+        fprintf(stderr, "%d RX/%d TX channels cannot be spread over %d boards\n",
+                s->rx_channel_count, s->tx_channel_count, s->device_count);
+        return -1;
+    }
+    s->rx_dev_ch = s->rx_channel_count / s->device_count;
+    s->tx_dev_ch = s->tx_channel_count ? s->tx_channel_count / s->device_count : 1;
+
+    /* Each RF port is a group of consecutive channels */
+    int rx_ch = 0, tx_ch = 0;
+    int dev_rate[MAX_NUM_DEV] = {0};
+    s->port_count = p->rf_port_count;
+    for (int i = 0; i < s->port_count; i++) {
+        TRXLmsPort *port = &s->port[i];
+        port->index = i;
+        port->rx_ch0 = rx_ch;
+        port->tx_ch0 = tx_ch;
+        port->rx_count = p->rx_port_channel_count[i];
+        port->tx_count = p->tx_port_channel_count[i];
+        if (s->port_count == 1 && !port->rx_count && !port->tx_count) {
+            port->rx_count = p->rx_channel_count;
+            port->tx_count = p->tx_channel_count;
+        }
+        port->sample_rate = (int64_t)p->sample_rate[i].num / p->sample_rate[i].den;
+        port->rx_stream = &s->rx_stream[port->rx_ch0];
+        port->tx_stream = &s->tx_stream[port->tx_ch0];
+        port->tx_buf = &s->tx_buf[port->tx_ch0];
+        port->dev_ts_offset = s->dev_ts_offset;
+        port->io_stop = &s->io_stop;
+        port->hw_offset = INT64_MIN;
+        trx_lms7002m_tdd_init(port, p, (double)p->sample_rate[i].num / p->sample_rate[i].den, s->tdd_gating);
+        rx_ch += port->rx_count;
+        tx_ch += port->tx_count;
+        printf("Port %d: RX ch %d..%d; TX ch %d..%d\n", i,
+               port->rx_ch0, rx_ch - 1, port->tx_ch0, tx_ch - 1);
+        if (rx_ch > p->rx_channel_count || tx_ch > p->tx_channel_count)
+            break;
+
+        /* the channels of a board share its clock generator */
+        for (int j = 0; j < port->rx_count + port->tx_count; j++) {
+            bool tx = j >= port->rx_count;
+            int ch = tx ? port->tx_ch0 + j - port->rx_count : port->rx_ch0 + j;
+            int b = trx_lms_dev_index(s, tx, ch);
+            if (tx)
+                port->tx_dev[ch - port->tx_ch0] = b;
+            else
+                port->rx_dev[ch - port->rx_ch0] = b;
+            if (dev_rate[b] && dev_rate[b] != port->sample_rate) {
+                fprintf(stderr, "Port %d: all ports of one board need the same sample rate\n", i);
+                return -1;
+            }
+            dev_rate[b] = port->sample_rate;
+        }
+    }
+    if (rx_ch != p->rx_channel_count || tx_ch != p->tx_channel_count) {
+        fprintf(stderr, "Port channel counts do not add up to the channel count\n");
+        return -1;
+    }
+
     if (s->ini_file == 0)
     {
         for(int ch=0; ch< s->rx_channel_count; ++ch)
         {
-            printf("Set CH%d gains: rx %1.0f; tx %1.0f\n",ch+1, p->rx_gain[ch], p->tx_gain[ch]);
-            LMS_EnableChannel(s->device,LMS_CH_RX,ch,true);
-            LMS_EnableChannel(s->device,LMS_CH_TX,ch,true);
-            LMS_SetGaindB(s->device,LMS_CH_RX,ch,(int)(p->rx_gain[ch]+0.5));
-            LMS_SetGaindB(s->device,LMS_CH_TX,ch,(int)(p->tx_gain[ch]+0.5));
+            printf("Set CH%d rx gain %1.0f\n",ch+1, p->rx_gain[ch]);
+            LMS_EnableChannel(trx_lms_dev(s, LMS_CH_RX, ch),LMS_CH_RX,trx_lms_chan(s, LMS_CH_RX, ch),true);
+            s->rx_rf_gain[ch] = -1000; /* force the RF gain */
+            trx_lms7002m_set_gain(s, LMS_CH_RX, ch, p->rx_gain[ch]);
+        }
+        for(int ch=0; ch< s->tx_channel_count; ++ch)
+        {
+            printf("Set CH%d tx gain %1.0f\n",ch+1, p->tx_gain[ch]);
+            LMS_EnableChannel(trx_lms_dev(s, LMS_CH_TX, ch),LMS_CH_TX,trx_lms_chan(s, LMS_CH_TX, ch),true);
+            s->tx_rf_gain[ch] = -1000;
+            trx_lms7002m_set_gain(s, LMS_CH_TX, ch, p->tx_gain[ch]);
         }
     }
     else
     {
         for(int ch=0; ch< s->rx_channel_count; ++ch)
         {
-	    int ant = LMS_GetAntenna(s->device, LMS_CH_RX, ch);
-	    LMS_SetAntenna(s->device, LMS_CH_RX, ch, ant);
+	    int ant = LMS_GetAntenna(trx_lms_dev(s, LMS_CH_RX, ch), LMS_CH_RX, trx_lms_chan(s, LMS_CH_RX, ch));
+	    LMS_SetAntenna(trx_lms_dev(s, LMS_CH_RX, ch), LMS_CH_RX, trx_lms_chan(s, LMS_CH_RX, ch), ant);
+	    unsigned gain = 0;
+	    LMS_GetGaindB(trx_lms_dev(s, LMS_CH_RX, ch), LMS_CH_RX, trx_lms_chan(s, LMS_CH_RX, ch), &gain);
+	    s->rx_rf_gain[ch] = gain;
 	}
         for(int ch=0; ch< s->tx_channel_count; ++ch)
         {
-	    int ant = LMS_GetAntenna(s->device, LMS_CH_TX, ch);
-	    LMS_SetAntenna(s->device, LMS_CH_TX, ch, ant);
+	    int ant = LMS_GetAntenna(trx_lms_dev(s, LMS_CH_TX, ch), LMS_CH_TX, trx_lms_chan(s, LMS_CH_TX, ch));
+	    LMS_SetAntenna(trx_lms_dev(s, LMS_CH_TX, ch), LMS_CH_TX, trx_lms_chan(s, LMS_CH_TX, ch), ant);
+	    unsigned gain = 0;
+	    LMS_GetGaindB(trx_lms_dev(s, LMS_CH_TX, ch), LMS_CH_TX, trx_lms_chan(s, LMS_CH_TX, ch), &gain);
+	    s->tx_rf_gain[ch] = gain;
 	}
     }
 
-    printf ("CH RX %d; TX %d\n",s->rx_channel_count,s->tx_channel_count);
+    printf ("CH RX %d; TX %d; boards %d\n",s->rx_channel_count,s->tx_channel_count,s->device_count);
     printf("SR:   %.3f MHz\n", (float)p->sample_rate[0].num / p->sample_rate[0].den/ 1e6);
     if (s->sample_rate || (!s->ini_file))
     {
         s->sample_rate = p->sample_rate[0].num / p->sample_rate[0].den;
         printf("DEC/INT: %d\n", s->dec_inter);
-        if ((LMS_SetSampleRateDir(s->device, LMS_CH_RX, s->sample_rate,s->dec_inter)!=0)
-         || (LMS_SetSampleRateDir(s->device, LMS_CH_TX, s->sample_rate,s->dec_inter)!=0))
+        for (int b = 0; b < s->device_count; b++)
         {
-            fprintf(stderr, "Failed to set sample rate\n");
-            return -1;
+            if ((LMS_SetSampleRateDir(s->devices[b], LMS_CH_RX, dev_rate[b],s->dec_inter)!=0)
+             || (LMS_SetSampleRateDir(s->devices[b], LMS_CH_TX, dev_rate[b],s->dec_inter)!=0))
+            {
+                fprintf(stderr, "Failed to set sample rate\n");
+                return -1;
+            }
         }
     }
     printf ("CH RX %d; TX %d\n",s->rx_channel_count,s->tx_channel_count);
 
+    if (s->fifo_mode == TRXLmsState::FIFO_AUTO)
+        trx_lms7002m_fifo_init(s, dev_rate);
+    s->fifo_next_size = s->fifo_size;
+    s->fifo_next_tvl = s->fifo_tvl;
+    printf("FIFO: %d samples, throughput/latency %.2f (%s, %s)\n", s->fifo_size, s->fifo_tvl,
+           s->fifo_mode == TRXLmsState::FIFO_AUTO ? "auto" : "fixed", s->link);
+
     for(int ch=0; ch< s->rx_channel_count; ++ch)
     {
 	    printf ("setup RX stream %d\n",ch);
-	    s->rx_stream[ch].channel = ch;
-	    s->rx_stream[ch].fifoSize = 256*1024;
-	    s->rx_stream[ch].throughputVsLatency = 0.3;
+	    s->rx_stream[ch].channel = trx_lms_chan(s, LMS_CH_RX, ch);
+	    s->rx_stream[ch].fifoSize = s->fifo_size;
+	    s->rx_stream[ch].throughputVsLatency = s->fifo_tvl;
 	    s->rx_stream[ch].isTx = false;
-    	    if (LMS_SetupStream(s->device, &s->rx_stream[ch])!=0)
+    	    if (LMS_SetupStream(trx_lms_dev(s, LMS_CH_RX, ch), &s->rx_stream[ch])!=0)
                 return -1;
     }
 
     for(int ch=0; ch< s->tx_channel_count; ++ch)
     {
 	    printf ("setup TX stream %d\n",ch);
-	    s->tx_stream[ch].channel = ch;
-	    s->tx_stream[ch].fifoSize = 256*1024;
-	    s->tx_stream[ch].throughputVsLatency = 0.3;
+	    s->tx_stream[ch].channel = trx_lms_chan(s, LMS_CH_TX, ch);
+	    s->tx_stream[ch].fifoSize = s->fifo_size;
+	    s->tx_stream[ch].throughputVsLatency = s->fifo_tvl;
 	    s->tx_stream[ch].isTx = true;
-	    if (LMS_SetupStream(s->device, &s->tx_stream[ch])!=0)
+	    if (LMS_SetupStream(trx_lms_dev(s, LMS_CH_TX, ch), &s->tx_stream[ch])!=0)
                 return -1;
     }
 
-    if (LMS_SetLOFrequency(s->device,LMS_CH_RX, 0, (double)p->rx_freq[0])!=0)
+    /* conversion buffers, or F32 TX staging for the digital gain: two
+       subframes per read/write before falling back to chunks */
     {
-        fprintf(stderr, "Failed to Set Rx frequency\n");
-        return -1;
+        int samples = 2 * (int)((int64_t)p->sample_rate[0].num / p->sample_rate[0].den / 1000);
+        if (samples < 4096)
+            samples = 4096;
+        if (trx_lms7002m_alloc_buffers(s, samples) != 0)
+            return -1;
     }
-
-    if (LMS_SetLOFrequency(s->device,LMS_CH_TX, 0,(double)p->tx_freq[0])!=0)
-    {
-        fprintf(stderr, "Failed to Set Tx frequency\n");
+    if (s->rx_pump)
+        for (int i = 0; i < s->port_count; i++)
+            if (s->port[i].rx_count && trx_lms7002m_ring_alloc(s, &s->port[i]) != 0)
+                return -1;
+    if (s->tx_writer)
+        for (int i = 0; i < s->port_count; i++)
+            if (s->port[i].tx_count && trx_lms7002m_writer_alloc(s, &s->port[i]) != 0)
+                return -1;
+    if (s->tx_coalesce)
+        for (int i = 0; i < s->port_count; i++)
+            if (s->port[i].tx_count && trx_lms7002m_coalesce_alloc(s, &s->port[i]) != 0)
+                return -1;
+    for (int i = 0; i < s->port_count; i++)
+        if (s->port[i].rx_count && trx_lms7002m_fill_alloc(s, &s->port[i]) != 0)
+            return -1;
+    if (s->rec_ring_ms && trx_lms7002m_rec_start(s) != 0)
         return -1;
-    }
 
-    if (s->rx_channel_count > 2)
-    {
-	    if (LMS_SetLOFrequency(s->device,LMS_CH_RX, 2, (double)p->rx_freq[0])!=0)
-	    {
-		fprintf(stderr, "Failed to Set Rx frequency\n");
-		return -1;
-	    }
-     }
-
-    if (s->tx_channel_count > 2)
+    /* One LO per LMS7002M on each board: channels 0/1 share the first
+       chip, boards with two chips (QPCIe) have channels 2/3 on the second */
+    if (trx_lms7002m_tune_build(s) != 0)
+        return -1;
+    s->rx_freq = p->rx_freq[0];
+    s->tx_freq = p->tx_freq[0];
+    for (int b = 0; b < s->device_count; b++)
     {
-	    if (LMS_SetLOFrequency(s->device,LMS_CH_TX, 2,(double)p->tx_freq[0])!=0)
-	    {
-		fprintf(stderr, "Failed to Set Tx frequency\n");
-		return -1;
-	    }
+        for (int ch = 0; ch < s->rx_dev_ch; ch += 2)
+        {
+            if (LMS_SetLOFrequency(s->devices[b],LMS_CH_RX, ch, (double)p->rx_freq[0])!=0)
+            {
+                fprintf(stderr, "Failed to Set Rx frequency\n");
+                return -1;
+            }
+        }
+        for (int ch = 0; ch < s->tx_dev_ch && s->tx_channel_count; ch += 2)
+        {
+            if (LMS_SetLOFrequency(s->devices[b],LMS_CH_TX, ch,(double)p->tx_freq[0])!=0)
+            {
+                fprintf(stderr, "Failed to Set Tx frequency\n");
+                return -1;
+            }
+        }
     }
 
-    if (s->calibrate & CALIBRATE_FILTER)
+    bool cal_cached = false;
+    if (s->calibrate && s->cal_cache && !(s->calibrate & CALIBRATE_FORCE))
+        cal_cached = trx_lms7002m_cal_restore(s, p) == 0;
+
+    if ((s->calibrate & CALIBRATE_FILTER) && !cal_cached)
     {
         for(int ch=0; ch< s->tx_channel_count; ++ch)
         {
             printf("Configuring Tx LPF for ch %i\n", ch);
+            lms_device_t *dev = trx_lms_dev(s, LMS_CH_TX, ch);
             unsigned gain = p->tx_gain[ch];
-            LMS_GetGaindB(s->device, LMS_CH_TX, ch, &gain);
-            if (LMS_SetLPFBW(s->device, LMS_CH_TX, ch,(double)(p->tx_bandwidth[0]>5e6 ? p->tx_bandwidth[0] : 5e6))!=0)
+            LMS_GetGaindB(dev, LMS_CH_TX, trx_lms_chan(s, LMS_CH_TX, ch), &gain);
+            if (LMS_SetLPFBW(dev, LMS_CH_TX, trx_lms_chan(s, LMS_CH_TX, ch),(double)(p->tx_bandwidth[0]>5e6 ? p->tx_bandwidth[0] : 5e6))!=0)
                 fprintf(stderr, "Failed set TX LPF\n");
-	    LMS_SetGaindB(s->device, LMS_CH_TX, ch, gain);
+	    LMS_SetGaindB(dev, LMS_CH_TX, trx_lms_chan(s, LMS_CH_TX, ch), gain);
         }
 
         for(int ch=0; ch< s->rx_channel_count; ++ch)
         {
             printf("Configuring Rx LPF for ch %i\n", ch);
-            if (LMS_SetLPFBW(s->device, LMS_CH_RX, ch,(double)p->rx_bandwidth[0])!=0)
+            if (LMS_SetLPFBW(trx_lms_dev(s, LMS_CH_RX, ch), LMS_CH_RX, trx_lms_chan(s, LMS_CH_RX, ch),(double)p->rx_bandwidth[0])!=0)
                 fprintf(stderr, "Failed to set RX LPF\n");
         }
     }
 
-    if (s->calibrate & CALIBRATE_IQDC)
+    if ((s->calibrate & CALIBRATE_IQDC) && !cal_cached)
     {
         for(int ch=0; ch< s->tx_channel_count; ++ch)
         {
             printf("Calibrating Tx channel :%i\n", ch);
-            if (LMS_Calibrate(s->device, LMS_CH_TX, ch,(double)p->tx_bandwidth[0],0)!=0)
+            if (LMS_Calibrate(trx_lms_dev(s, LMS_CH_TX, ch), LMS_CH_TX, trx_lms_chan(s, LMS_CH_TX, ch),(double)p->tx_bandwidth[0],0)!=0)
                 fprintf(stderr, "Failed to calibrate Tx\n");
         }
 
         for(int ch=0; ch< s->rx_channel_count; ++ch)
         {
             printf("Calibrating Rx channel :%i\n", ch);
-            if (LMS_Calibrate(s->device, LMS_CH_RX, ch,(double)p->rx_bandwidth[0],0)!=0)
+            if (LMS_Calibrate(trx_lms_dev(s, LMS_CH_RX, ch), LMS_CH_RX, trx_lms_chan(s, LMS_CH_RX, ch),(double)p->rx_bandwidth[0],0)!=0)
                 fprintf(stderr, "Failed to calibrate Rx\n");
         }
     }
+    if (s->calibrate && s->cal_cache && !cal_cached)
+        trx_lms7002m_cal_store(s, p);
     LMS_RegisterLogHandler(LogHandler);
+    /* from now on gains and messages go through the control thread */
+    trx_lms7002m_ctrl_init(s);
     printf("Running\n");
     return 0;
 }
 
+/*
+ * Register shadow of the binary images
+ *
+ * At trx_end the registers of the loaded image are read back from each
+ * board into <cache>/lms7002m_<serial>.regs (calibration_cache
+ * directory), in the image format. The next image load on that board
+ * only writes the registers whose value differs from the shadow. The file
+ * is removed when loaded: a run that does not end cleanly leaves none, and
+ * a sample of the registers to be skipped is read back to catch a board
+ * power cycled meanwhile.
+ */
+#define SHADOW_CHECK_REGS       16
+
+static void trx_lms7002m_shadow_path(TRXLmsState *s, int b, char *path, int size)
+{
+    const lms_dev_info_t *info = LMS_GetDeviceInfo(s->devices[b]);
+    uint64_t serial = info ? info->boardSerialNumber : 0;
+
+    snprintf(path, size, "%s/lms7002m_%016" PRIx64 ".regs", s->cal_cache, serial);
+}
+
+/* Shadow of board 'b' with the layout of the image 'reg', 0 if usable */
+static int trx_lms7002m_shadow_load(TRXLmsState *s, int b, const LmsImageReg *reg, int count, LmsImageReg *shadow)
+{
+    lms_device_t *dev = s->devices[b];
+    LmsImageHeader hdr;
+    char path[512];
+    uint16_t mac, val;
+    int ret = -1, n = 0;
+
+    trx_lms7002m_shadow_path(s, b, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    if (fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == LMS_IMAGE_MAGIC &&
+        hdr.version == LMS_IMAGE_VERSION && hdr.count == count &&
+        fread(shadow, sizeof(*shadow), count, f) == (size_t)count &&
+        lms_image_checksum(shadow, count) == hdr.checksum)
+        ret = 0;
+    fclose(f);
+    unlink(path);       /* stale once registers are written */
+
+    for (int i = 0; i < count && !ret; i++)
+        if (shadow[i].addr != reg[i].addr || shadow[i].mac != reg[i].mac)
+            ret = -1;
+    if (ret || LMS_ReadLMSReg(dev, 0x0020, &mac) != 0)
+        return -1;
+
+    /* spot check among the non zero registers that would be skipped */
+    for (int i = 0; i < count; i++)
+        if (reg[i].addr != 0x0020 && reg[i].val && shadow[i].val == reg[i].val)
+            n++;
+    for (int i = 0, k = 0; i < count && !ret; i++) {
+        if (reg[i].addr == 0x0020 || !reg[i].val || shadow[i].val != reg[i].val)
+            continue;
+        if (k++ % ((n + SHADOW_CHECK_REGS - 1) / SHADOW_CHECK_REGS))
+            continue;
+        if (LMS_WriteLMSReg(dev, 0x0020, (mac & ~3) | reg[i].mac) != 0 ||
+            LMS_ReadLMSReg(dev, reg[i].addr, &val) != 0 || val != reg[i].val)
+            ret = -1;
+    }
+    LMS_WriteLMSReg(dev, 0x0020, mac);
+    return ret;
+}
+
+static void trx_lms7002m_shadow_save(TRXLmsState *s)
+{
+    LmsImageHeader hdr;
+    LmsImageReg *cur;
+    char path[512], tmp[520];
+
+    if (!s->image || !s->cal_cache)
+        return;
+    cur = (LmsImageReg*)malloc(s->image_count * sizeof(*cur));
+    if (!cur)
+        return;
+    for (int b = 0; b < s->device_count; b++) {
+        lms_device_t *dev = s->devices[b];
+        uint16_t mac;
+        int ret, sel = 0;
+
+        if (LMS_ReadLMSReg(dev, 0x0020, &mac) != 0)
+            continue;
+        ret = 0;
+        for (int i = 0; i < s->image_count && !ret; i++) {
+            cur[i] = s->image[i];
+            if (cur[i].addr == 0x0020)
+                continue;
+            if (cur[i].mac != sel) {
+                sel = cur[i].mac;
+                ret |= LMS_WriteLMSReg(dev, 0x0020, (mac & ~3) | sel);
+            }
+            ret |= LMS_ReadLMSReg(dev, cur[i].addr, &cur[i].val);
+        }
+        ret |= LMS_WriteLMSReg(dev, 0x0020, mac);
+        if (ret)
+            continue;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = LMS_IMAGE_MAGIC;
+        hdr.version = LMS_IMAGE_VERSION;
+        hdr.count = s->image_count;
+        hdr.checksum = lms_image_checksum(cur, s->image_count);
+        trx_lms7002m_shadow_path(s, b, path, sizeof(path));
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        FILE *f = fopen(tmp, "wb");
+        if (!f) {
+            fprintf(stderr, "Register shadow: cannot write %s\n", tmp);
+            continue;
+        }
+        fwrite(&hdr, sizeof(hdr), 1, f);
+        fwrite(cur, sizeof(*cur), s->image_count, f);
+        if (fclose(f) != 0 || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
+    free(cur);
+}
+
+/* Binary register image from lms_ini2bin: every register is written, or
+ * only those differing from the board's shadow when there is one, so
+ * restarting with the same profile, or switching between profiles, only
+ * costs the delta. */
+static int trx_lms7002m_load_image(TRXLmsState *s, const char *path)
+{
+    LmsImageHeader hdr;
+    LmsImageReg *reg = NULL, *shadow = NULL;
+    uint16_t ctrl = 0xFFFD;     /* 0x0020 of the image: MAC and resets */
+    int ret = -1;
+    FILE *f = fopen(path, "rb");
+
+    if (!f)
+        return -1;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != LMS_IMAGE_MAGIC ||
+        hdr.version != LMS_IMAGE_VERSION || hdr.count > LMS_IMAGE_MAX_REGS) {
+        fprintf(stderr, "%s: not a register image\n", path);
+        goto done;
+    }
+    reg = (LmsImageReg*)malloc(hdr.count * sizeof(*reg));
+    if (!reg || fread(reg, sizeof(*reg), hdr.count, f) != hdr.count ||
+        lms_image_checksum(reg, hdr.count) != hdr.checksum) {
+        fprintf(stderr, "%s: corrupted register image\n", path);
+        goto done;
+    }
+    shadow = (LmsImageReg*)malloc(hdr.count * sizeof(*shadow));
+    if (!shadow)
+        goto done;
+    for (int i = 0; i < hdr.count; i++)
+        if (reg[i].addr == 0x0020 && reg[i].mac == 1)
+            ctrl = reg[i].val;
+
+    for (int b = 0; b < s->device_count; b++) {
+        lms_device_t *dev = s->devices[b];
+        int mac = 0, written = 0;
+        bool diff = s->cal_cache && trx_lms7002m_shadow_load(s, b, reg, hdr.count, shadow) == 0;
+
+        for (int i = 0; i < hdr.count; i++) {
+            if (reg[i].addr == 0x0020)
+                continue;
+            if (diff && shadow[i].val == reg[i].val)
+                continue;
+            if (reg[i].mac != mac) {
+                mac = reg[i].mac;
+                if (LMS_WriteLMSReg(dev, 0x0020, (ctrl & ~3) | mac) != 0)
+                    goto done;
+            }
+            if (LMS_WriteLMSReg(dev, reg[i].addr, reg[i].val) != 0)
+                goto done;
+            written++;
+        }
+        if (LMS_WriteLMSReg(dev, 0x0020, ctrl) != 0)
+            goto done;
+
+        /* LimeSuite tunes the synthesizers from its own reference value */
+        if (hdr.sxt_ref_hz && hdr.sxt_ref_hz == hdr.sxr_ref_hz) {
+            float_type ref = 0;
+            if (LMS_GetClockFreq(dev, LMS_CLOCK_REF, &ref) != 0 || fabs(ref - hdr.sxt_ref_hz) > 1)
+                LMS_SetClockFreq(dev, LMS_CLOCK_REF, hdr.sxt_ref_hz);
+        } else if (hdr.sxt_ref_hz != hdr.sxr_ref_hz) {
+            fprintf(stderr, "%s: different SXT/SXR reference clocks, not applied\n", path);
+        }
+        printf("Register image: board %d, %d of %d registers written%s\n",
+               b, written, hdr.count, diff ? " (shadow)" : "");
+    }
+    s->image = reg;
+    s->image_count = hdr.count;
+    reg = NULL;
+    ret = 0;
+ done:
+    free(shadow);
+    free(reg);
+    fclose(f);
+    return ret;
+}
+
+/* Core of each port's thread from a "2,3" list, -1 when not given.
+ * With fewer cores than ports the last one is shared. */
+static void trx_lms7002m_cpu_list(TRXState *s1, const char *name, int *cpu)
+{
+    char *list = trx_get_param_string(s1, name);
+    int i = 0;
+
+    for (int j = 0; j < MAX_NUM_PORT; j++)
+        cpu[j] = -1;
+    if (!list)
+        return;
+    for (char *tok = strtok(list, ", "); tok && i < MAX_NUM_PORT; tok = strtok(NULL, ", "))
+        cpu[i++] = atoi(tok);
+    for (; i > 0 && i < MAX_NUM_PORT; i++)
+        cpu[i] = cpu[i - 1];
+    free(list);
+}
+
 /* Driver initialization called at eNB startup */
 int trx_driver_init(TRXState *s1)
 {
     double val;
     char *configFile, *configFile1;
     int lms7002_index;
-    int stream_index;
     TRXLmsState *s;
     lms_info_str_t list[16]={0};
 
@@ -469,8 +4249,11 @@ int trx_driver_init(TRXState *s1)
         return -1;
     }
 
-    s = (TRXLmsState*)malloc(sizeof(TRXLmsState));
-    memset(s, 0, sizeof(*s));
+    /* cache line aligned for the counters */
+    if (posix_memalign((void**)&s, 64, sizeof(TRXLmsState)) != 0)
+        return -1;
+    memset((void*)s, 0, sizeof(*s));
+    pthread_mutex_init(&s->start_lock, NULL);
 
     /* Few parameters */
     s->sample_rate = 0;
@@ -481,6 +4264,63 @@ int trx_driver_init(TRXState *s1)
     if (trx_get_param_double(s1, &val, "dec_inter") >= 0)
         s->dec_inter = val;
 
+    s->hugepages = 0;
+    if (trx_get_param_double(s1, &val, "hugepages") >= 0)
+        s->hugepages = val;
+
+    if (trx_get_param_double(s1, &val, "rx_pump") >= 0)
+        s->rx_pump = val != 0;
+    trx_lms7002m_cpu_list(s1, "rx_pump_cpu", s->pump_cpu);
+    if (trx_get_param_double(s1, &val, "rx_pump_priority") >= 0)
+        s->pump_prio = val;
+    s->pump_ring_ms = RX_PUMP_RING_MS;
+    if (trx_get_param_double(s1, &val, "rx_pump_ring_ms") >= 0 && val >= 1)
+        s->pump_ring_ms = val;
+
+    if (trx_get_param_double(s1, &val, "tx_writer") >= 0)
+        s->tx_writer = val != 0;
+    trx_lms7002m_cpu_list(s1, "tx_writer_cpu", s->writer_cpu);
+    if (trx_get_param_double(s1, &val, "tx_writer_priority") >= 0)
+        s->writer_prio = val;
+    s->writer_queue_ms = TX_QUEUE_MS;
+    if (trx_get_param_double(s1, &val, "tx_writer_queue_ms") >= 0 && val >= 1)
+        s->writer_queue_ms = val;
+
+    if (trx_get_param_double(s1, &val, "tx_coalesce") >= 0)
+        s->tx_coalesce = val != 0;
+    s->tx_coalesce_us = TX_COALESCE_US;
+    if (trx_get_param_double(s1, &val, "tx_coalesce_deadline_us") >= 0 && val >= 0)
+        s->tx_coalesce_us = val;
+    s->rx_fill_us = RX_FILL_US;
+    if (trx_get_param_double(s1, &val, "rx_gap_fill_us") >= 0 && val >= 0)
+        s->rx_fill_us = val;
+    if (trx_get_param_double(s1, &val, "record_ring_ms") >= 0 && val >= 0)
+        s->rec_ring_ms = val;
+    char *tune = trx_get_param_string(s1, "retune_freqs");
+    if (tune) {
+        for (char *tok = strtok(tune, ", "); tok && s->tune_count < RETUNE_MAX; tok = strtok(NULL, ", "))
+            if (atof(tok) > 0)
+                s->tune_freq[s->tune_count++] = atof(tok);
+        free(tune);
+    }
+
+    /* Replay of "record" files instead of the air, simulated boards only */
+    char *replay = trx_get_param_string(s1, "replay");
+    if (replay) {
+        char *pace = trx_get_param_string(s1, "replay_pace");
+        bool unthrottled = pace && !strcmp(pace, "max");
+        if (pace && !unthrottled && strcmp(pace, "realtime"))
+            fprintf(stderr, "Unknown replay_pace '%s', using realtime\n", pace);
+        free(pace);
+        if (!lms_sim_replay) {
+            fprintf(stderr, "replay needs the simulated LimeSuite (trx_lms7002m_sim.so)\n");
+            free(replay);
+            return -1;
+        }
+        lms_sim_replay(replay, unthrottled);
+        free(replay);
+    }
+
     /* Get device index */
     lms7002_index = 0;
     if (trx_get_param_double(s1, &val, "lms7002_index") >= 0)
@@ -500,16 +4340,100 @@ int trx_driver_init(TRXState *s1)
         lms7002_index = 0;
     }
 
-    if (LMS_Open(&(s->device),list[lms7002_index],stream_index>=0?list[stream_index]:nullptr)!=0) {
-        fprintf(stderr, "Can't open lms port\n");
-        return -1;
+    /* Several boards: comma separated list of device indexes or serial
+       numbers, presented to LTEENB as one device with all their channels */
+    int dev_index[MAX_NUM_DEV];
+    s->device_count = 1;
+    dev_index[0] = lms7002_index;
+    char *devList = trx_get_param_string(s1, "lms7002_list");
+    if (devList)
+    {
+        s->device_count = 0;
+        for (char *tok = strtok(devList, ", "); tok; tok = strtok(NULL, ", "))
+        {
+            int idx = -1;
+            char *end;
+            long v = strtol(tok, &end, 0);
+            if (*end == '\0')
+                idx = v;
+            else
+                for (int i = 0; i < n && idx < 0; i++)
+                    if (strstr(list[i], tok))
+                        idx = i;
+            if (idx < 0 || idx >= n || s->device_count == MAX_NUM_DEV)
+            {
+                fprintf(stderr, "Board '%s' not available\n", tok);
+                free(devList);
+                return -1;
+            }
+            dev_index[s->device_count++] = idx;
+        }
+        free(devList);
+        if (s->device_count == 0)
+            return -1;
+    }
+
+    for (int i = 0; i < s->device_count; i++)
+    {
+        printf("Board %d: %s\n", i, list[dev_index[i]]);
+        if (LMS_Open(&(s->devices[i]),list[dev_index[i]],nullptr)!=0) {
+            fprintf(stderr, "Can't open lms port\n");
+            return -1;
+        }
+    }
+    s->rx_dev_ch = s->tx_dev_ch = 2;
+
+    /* TDD: no TX outside the downlink bursts of the cell configuration */
+    s->tdd_gating = true;
+    if (trx_get_param_double(s1, &val, "tdd_gating") >= 0)
+        s->tdd_gating = val != 0;
+
+    /* Link of the first board, e.g. "USB 3.0" or "PCIe" */
+    const char *media = strstr(list[dev_index[0]], "media=");
+    if (media) {
+        media += 6;
+        size_t len = strcspn(media, ",");
+        if (len >= sizeof(s->link))
+            len = sizeof(s->link) - 1;
+        memcpy(s->link, media, len);
+    }
+
+    /* Stream FIFO */
+    s->fifo_mode = TRXLmsState::FIFO_FIXED;
+    s->fifo_size = FIFO_SIZE;
+    s->fifo_tvl = FIFO_TVL;
+    char *fifoMode = trx_get_param_string(s1, "fifo_mode");
+    if (fifoMode) {
+        if (!strcmp(fifoMode, "auto"))
+            s->fifo_mode = TRXLmsState::FIFO_AUTO;
+        else if (strcmp(fifoMode, "fixed"))
+            fprintf(stderr, "Unknown fifo_mode '%s', using fixed\n", fifoMode);
+        free(fifoMode);
+    }
+    if (trx_get_param_double(s1, &val, "fifo_size") >= 0)
+        s->fifo_size = val < FIFO_MIN ? FIFO_MIN : val > FIFO_MAX ? FIFO_MAX : val;
+    if (trx_get_param_double(s1, &val, "throughput_vs_latency") >= 0)
+        s->fifo_tvl = val < 0 ? 0 : val > 1 ? 1 : val;
+    s->fifo_state_file = trx_get_param_string(s1, "fifo_state_file");
+
+    s->sync_tolerance = SYNC_TOLERANCE;
+    if (trx_get_param_double(s1, &val, "sync_tolerance") >= 0)
+        s->sync_tolerance = val;
+
+    s->dgain_range = DGAIN_RANGE;
+    if (trx_get_param_double(s1, &val, "digital_gain_range") >= 0)
+        s->dgain_range = val < 0 ? 0 : val;
+    for (int ch = 0; ch < MAX_NUM_CH; ch++) {
+        s->rx_dgain[ch] = 1.0f;
+        s->tx_dgain[ch] = 1.0f;
     }
 
     s->tcxo_calc = -1;
     if (trx_get_param_double(s1, &val, "tcxo_calc") >= 0)
     {
         s->tcxo_calc = val;
-        LMS_WriteCustomBoardParam(s->device, 0, val, "");
+        for (int i = 0; i < s->device_count; i++)
+            LMS_WriteCustomBoardParam(s->devices[i], 0, val, "");
 	printf("DAC WRITE %d\n", s->tcxo_calc);
     }
 
@@ -530,6 +4454,9 @@ int trx_driver_init(TRXState *s1)
         printf("tx power %.1f dBm\n", s->tx_power);
     }
 
+    /* also holds the register state saved for the binary images */
+    s->cal_cache = trx_get_param_string(s1, "calibration_cache");
+
     //Configuration INI file
     configFile = trx_get_param_string(s1, "config_file");
     if (configFile)
@@ -538,34 +4465,55 @@ int trx_driver_init(TRXState *s1)
         sprintf(configFile1, "%s/%s", s1->path, configFile);
 
         fprintf(stderr, "Config file: %s\n", configFile1);
-        if  (LMS_LoadConfig(s->device,configFile1)!=0) //load registers configuration from file
+        size_t len = strlen(configFile1);
+        if (len > 4 && !strcasecmp(configFile1 + len - 4, ".bin"))
         {
-            fprintf(stderr, "Can't open %s\n", configFile1);
-            return -1;
+            if (trx_lms7002m_load_image(s, configFile1) != 0)
+            {
+                fprintf(stderr, "Can't load %s\n", configFile1);
+                return -1;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < s->device_count; i++)
+            {
+                if  (LMS_LoadConfig(s->devices[i],configFile1)!=0) //load registers configuration from file
+                {
+                    fprintf(stderr, "Can't open %s\n", configFile1);
+                    return -1;
+                }
+            }
         }
         free(configFile1);
         s->ini_file = 1;
     }
     else
     {
-        if ( LMS_Init(s->device)!=0)
+        for (int i = 0; i < s->device_count; i++)
         {
-            fprintf(stderr, "LMS Init failed\n");
-            return -1;
+            if ( LMS_Init(s->devices[i])!=0)
+            {
+                fprintf(stderr, "LMS Init failed\n");
+                return -1;
+            }
         }
         s->ini_file = 0;
     }
 
     /* Auto calibration */
     char* calibration;
-    LMS_EnableCache(s->device,false);
+    for (int i = 0; i < s->device_count; i++)
+        LMS_EnableCache(s->devices[i],false);
     calibration = trx_get_param_string(s1, "calibration");
     s->calibrate = CALIBRATE_FILTER;
     if (calibration)
     {
 	if (!strcasecmp(calibration, "none"))
 	    s->calibrate = 0;
-	else if ((!strcasecmp(calibration, "force")) || (!strcasecmp(calibration, "all")))
+	else if (!strcasecmp(calibration, "force"))
+            s->calibrate = CALIBRATE_FILTER | CALIBRATE_IQDC | CALIBRATE_FORCE;
+	else if (!strcasecmp(calibration, "all"))
             s->calibrate = CALIBRATE_FILTER | CALIBRATE_IQDC;
         else if (!strcasecmp(calibration, "filter"))
             s->calibrate = CALIBRATE_FILTER;
@@ -573,6 +4521,9 @@ int trx_driver_init(TRXState *s1)
             s->calibrate = CALIBRATE_IQDC;
         free(calibration);
     }
+    s->cal_max_age = CAL_MAX_AGE * 3600;
+    if (trx_get_param_double(s1, &val, "calibration_max_age") >= 0)
+        s->cal_max_age = val * 3600;
     /*sample format*/
     for (int i =0; i< MAX_NUM_CH; i++)
         s->rx_stream[i].dataFmt = s->tx_stream[i].dataFmt = lms_stream_t::LMS_FMT_F32;
@@ -590,6 +4541,11 @@ int trx_driver_init(TRXState *s1)
         free(sampleFmt);
     }
 
+    /* Conversion kernels for the 16b/12b sample formats */
+    char* simd = trx_get_param_string(s1, "simd");
+    trx_lms_conv_init(simd);
+    free(simd);
+
     /* Set callbacks */
     s1->opaque = s;
     s1->trx_end_func = trx_lms7002m_end;
@@ -600,6 +4556,9 @@ int trx_driver_init(TRXState *s1)
     s1->trx_start_func = trx_lms7002m_start;
     s1->trx_get_sample_rate_func = trx_lms7002m_get_sample_rate;
     s1->trx_get_tx_samples_per_packet_func = trx_lms7002m_get_tx_samples_per_packet_func;
+    s1->trx_get_stats = trx_lms7002m_get_stats;
+    s1->trx_dump_info = trx_lms7002m_dump_info;
+    s1->trx_msg_recv_func = trx_lms7002m_msg_recv;
     s1->trx_get_abs_rx_power_func = trx_lms7002m_get_abs_rx_power_func;
     s1->trx_get_abs_tx_power_func = trx_lms7002m_get_abs_tx_power_func;
     s1->trx_set_tx_gain_func = trx_lms7002m_set_tx_gain_func;